@@ -0,0 +1,51 @@
+#! /bin/bash
+
+# Throughput of pzip against the serial wzip, on generated inputs:
+#   ./bench.sh [megabytes]
+# Checks that the two outputs are identical, then reports MB/s for each.
+
+MB=${1:-512}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+WZIP=../initial-utilities/wzip/wzip.c
+gcc -Wall -Werror -pthread -O -o $DIR/pzip pzip.c || exit 1
+gcc -Wall -Werror -O -o $DIR/wzip $WZIP || exit 1
+
+# log-like text (short runs), and a file of long runs
+python3 - $DIR $MB <<'EOF'
+import random, sys
+d, mb = sys.argv[1], int(sys.argv[2])
+random.seed(1)
+line = b"2024-05-17 12:00:00 INFO  request served     ok\n"
+with open(d + "/log", "wb") as f:
+    block = b"".join(line.replace(b"ok", random.choice([b"ok", b"slow", b"aaaa"]))
+                     for _ in range(20000))
+    for _ in range(mb * (1 << 20) // len(block)):
+        f.write(block)
+with open(d + "/runs", "wb") as f:
+    block = b"".join(bytes([random.randrange(256)]) * random.randrange(1, 5000)
+                     for _ in range(2000))
+    for _ in range(mb * (1 << 20) // len(block)):
+        f.write(block)
+EOF
+
+now() { date +%s%N; }
+
+for input in log runs; do
+    f=$DIR/$input
+    size=$(stat -c %s $f)
+    cat $f > /dev/null # warm the page cache
+    for tool in wzip pzip; do
+        start=$(now)
+        $DIR/$tool $f > $DIR/$tool.out
+        end=$(now)
+        awk -v tool=$tool -v input=$input -v size=$size -v ns=$((end - start)) \
+            'BEGIN { printf "%-5s %-5s %8.1f MB/s  (%.3f s)\n", input, tool, size / 1048576 / (ns / 1e9), ns / 1e9 }'
+    done
+    if ! cmp -s $DIR/wzip.out $DIR/pzip.out; then
+        echo "$input: pzip output differs from wzip"
+        exit 1
+    fi
+done
+echo "threads: $(nproc)"
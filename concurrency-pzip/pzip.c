@@ -0,0 +1,240 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+// Parallel version of wzip: same output, byte for byte.
+//
+// The input files are mapped (or, if they are pipes and the like, read
+// into memory) and cut into CHUNK-byte pieces (a piece never spans two
+// files).  Worker threads take pieces in order, as they become free, so a
+// slow thread simply ends up doing fewer, and run-length encode each into
+// its own output slot.  The main thread writes the slots out in order,
+// joining a run that crosses from one piece (or file) into the next.
+// There are SLOTS_PER_THREAD slots per thread, which bounds how far the
+// workers can get ahead of the writer, and so the memory in use.
+
+#define CHUNK (1 << 20)
+#define SLOTS_PER_THREAD 4
+#define RECORD 5 // 4-byte count, then the byte
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+} piece_t;
+
+typedef struct {
+  long piece;    // which piece the slot holds, -1 if none yet
+  int done;      // encoded and ready to write
+  char *out;     // RECORD * CHUNK bytes: the worst case, no runs at all
+  size_t outlen;
+} slot_t;
+
+static piece_t *pieces;
+static long npieces;
+static slot_t *slots;
+static int nslots;
+
+static long next_piece = 0; // next one a worker takes
+static long written = 0;    // pieces the writer is finished with
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slot_done = PTHREAD_COND_INITIALIZER;
+
+static char *put_run(char *out, uint32_t count, unsigned char c) {
+  memcpy(out, &count, 4);
+  out[4] = c;
+  return out + RECORD;
+}
+
+// the same loop as wzip's, minus the stdio: returns the end of the records
+static char *encode(const unsigned char *p, size_t len, char *out) {
+  const unsigned char *end = p + len;
+  while (p < end) {
+    const unsigned char *q = p + 1;
+    while (q < end && *q == *p)
+      q++;
+    out = put_run(out, q - p, *p);
+    p = q;
+  }
+  return out;
+}
+
+static void *worker(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&lock);
+    long i = next_piece++;
+    if (i >= npieces) {
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+    // piece i goes in the slot that piece i - nslots used
+    while (i >= written + nslots)
+      pthread_cond_wait(&slot_free, &lock);
+    slot_t *s = &slots[i % nslots];
+    pthread_mutex_unlock(&lock);
+
+    if (s->out == NULL && (s->out = malloc((size_t)RECORD * CHUNK)) == NULL) {
+      perror("pzip");
+      exit(1);
+    }
+    s->outlen = encode(pieces[i].data, pieces[i].len, s->out) - s->out;
+
+    pthread_mutex_lock(&lock);
+    s->piece = i;
+    s->done = 1;
+    pthread_cond_broadcast(&slot_done);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+// reads what cannot be mapped (a pipe, a terminal) into memory instead
+static unsigned char *read_all(int fd, size_t *size) {
+  size_t cap = CHUNK, n = 0;
+  unsigned char *buf = malloc(cap);
+  while (buf != NULL) {
+    if (n == cap) {
+      unsigned char *bigger = realloc(buf, cap *= 2);
+      if (bigger == NULL)
+        break;
+      buf = bigger;
+    }
+    ssize_t rc = read(fd, buf + n, cap - n);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      break;
+    if (rc == 0) {
+      *size = n;
+      return buf;
+    }
+    n += rc;
+  }
+  free(buf);
+  return NULL;
+}
+
+// adds the pieces of one file to the list
+static int map_file(const char *name, size_t *cap) {
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat sb;
+  const unsigned char *data;
+  size_t size;
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (S_ISREG(sb.st_mode)) {
+    size = sb.st_size;
+    data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    if (size > 0)
+      madvise((void *)data, size, MADV_SEQUENTIAL);
+  } else if ((data = read_all(fd, &size)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  for (size_t off = 0; off < size; off += CHUNK) {
+    if (npieces == *cap) {
+      *cap = *cap ? *cap * 2 : 64;
+      if ((pieces = realloc(pieces, *cap * sizeof(piece_t))) == NULL)
+        return -1;
+    }
+    pieces[npieces].data = data + off;
+    pieces[npieces].len = size - off < CHUNK ? size - off : CHUNK;
+    npieces++;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 1) {
+    printf("pzip: file1 [file2 ...]\n");
+    return 1;
+  }
+
+  // wzip stops at the first file it cannot open, having written out every
+  // run before it but the last, which might have gone on into that file
+  int failed = 0;
+  size_t cap = 0;
+  for (int i = 1; i < argc && !failed; i++)
+    failed = map_file(argv[i], &cap) < 0;
+
+  int nthreads = get_nprocs();
+  if (nthreads > npieces)
+    nthreads = npieces > 0 ? npieces : 1;
+  nslots = nthreads * SLOTS_PER_THREAD;
+  slots = calloc(nslots, sizeof(slot_t));
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  if (slots == NULL || threads == NULL) {
+    perror("pzip");
+    return 1;
+  }
+  for (int i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, NULL);
+
+  static char obuf[1 << 16];
+  setvbuf(stdout, obuf, _IOFBF, sizeof(obuf));
+
+  // the run still open at the end of what has been written so far
+  uint32_t count = 0;
+  unsigned char last = 0;
+  int have = 0;
+  for (long i = 0; i < npieces; i++) {
+    slot_t *s = &slots[i % nslots];
+    pthread_mutex_lock(&lock);
+    while (!(s->done && s->piece == i))
+      pthread_cond_wait(&slot_done, &lock);
+    pthread_mutex_unlock(&lock);
+
+    // a piece is never empty, so it holds at least one run
+    char *r = s->out, *end = s->out + s->outlen;
+    uint32_t first;
+    memcpy(&first, r, 4);
+    if (have && (unsigned char)r[4] == last) {
+      count += first;
+      r += RECORD;
+    }
+    if (r < end) {
+      if (have) {
+        fwrite(&count, 4, 1, stdout);
+        fwrite(&last, 1, 1, stdout);
+      }
+      // all but the last run are complete; write them as they are
+      fwrite(r, 1, end - RECORD - r, stdout);
+      memcpy(&count, end - RECORD, 4);
+      last = end[-1];
+      have = 1;
+    }
+
+    pthread_mutex_lock(&lock);
+    s->done = 0;
+    written = i + 1;
+    pthread_cond_broadcast(&slot_free);
+    pthread_mutex_unlock(&lock);
+  }
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  if (failed)
+    return 1;
+  if (have) {
+    fwrite(&count, 4, 1, stdout);
+    fwrite(&last, 1, 1, stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+#! /bin/bash
+
+# psort against a plain qsort() of the records, on generated inputs:
+#   ./bench.sh [megabytes]
+# Checks psort's output with gen -c, then reports MB/s for each, for keys
+# that are random and for keys with only 16 bits that vary.  "external" is
+# psort held to a quarter of the input's size in memory (-m), which makes
+# it sort in runs and merge them.
+
+MB=${1:-1024}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+gcc -Wall -Werror -pthread -O -o $DIR/psort psort.c || exit 1
+gcc -Wall -Werror -O -o $DIR/gen gen.c || exit 1
+# the obvious way: read it all, qsort() it, write it out
+cat > $DIR/qsort.c <<'C'
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+static int cmp(const void *x, const void *y) {
+  uint32_t a, b;
+  memcpy(&a, x, 4);
+  memcpy(&b, y, 4);
+  return a < b ? -1 : a > b;
+}
+int main(int argc, char *argv[]) {
+  FILE *in = fopen(argv[1], "r"), *out = fopen(argv[2], "w");
+  fseek(in, 0, SEEK_END);
+  long size = ftell(in);
+  rewind(in);
+  char *data = malloc(size);
+  if (fread(data, 1, size, in) != size)
+    return 1;
+  qsort(data, size / 100, 100, cmp);
+  fwrite(data, 1, size, out);
+  fflush(out);
+  return fsync(fileno(out));
+}
+C
+gcc -O -o $DIR/qsort $DIR/qsort.c || exit 1
+
+now() { date +%s%N; }
+records=$((MB * 1048576 / 100))
+
+for keys in random 16bit; do
+    args=()
+    [ $keys = 16bit ] && args=(-k 16)
+    $DIR/gen "${args[@]}" $records $DIR/input
+    cat $DIR/input > /dev/null # warm the page cache
+    for tool in psort external qsort; do
+        rm -f $DIR/output
+        cmd=($DIR/$tool)
+        [ $tool = external ] && cmd=($DIR/psort -m $((MB / 4 > 0 ? MB / 4 : 1)))
+        start=$(now)
+        "${cmd[@]}" $DIR/input $DIR/output
+        end=$(now)
+        awk -v tool=$tool -v keys=$keys -v mb=$MB -v ns=$((end - start)) \
+            'BEGIN { printf "%-6s %-8s %8.1f MB/s  (%.3f s)\n", keys, tool, mb / (ns / 1e9), ns / 1e9 }'
+        if [ $tool != qsort ] && ! $DIR/gen -c $DIR/input $DIR/output; then
+            exit 1
+        fi
+    done
+done
+echo "threads: $(nproc)"
@@ -0,0 +1,23 @@
+#! /bin/bash
+
+# Sorts an input just past 42,949,672 records, where a record's offset
+# (index * 100) no longer fits in 32 bits, and checks the output with
+# gen -c.  psort is given memory enough (-m) to sort it all at once,
+# whatever the machine has, since that is the path that indexes records
+# with 32 bits.  Needs about 9 GB of disk in $TMPDIR.
+#   ./check.sh
+
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+gcc -Wall -Werror -pthread -O -o $DIR/psort psort.c || exit 1
+gcc -Wall -Werror -O -o $DIR/gen gen.c || exit 1
+
+records=43000000
+# COST in psort.c: 2 * 100 + 2 * 8 bytes a record
+mb=$((records * 216 / 1048576 + 1))
+
+$DIR/gen $records $DIR/input || exit 1
+$DIR/psort -m $mb $DIR/input $DIR/output || exit 1
+$DIR/gen -c $DIR/input $DIR/output || exit 1
+echo "$records records: ok"
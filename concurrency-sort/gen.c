@@ -0,0 +1,137 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Makes input for psort, and checks what it makes of it.
+//
+//   ./gen [-k bits] records file   writes that many random records; with -k,
+//                                  only the low bits of each key vary
+//   ./gen -c input output          checks that output holds the records of
+//                                  input, sorted, equal keys in input order
+//
+// Each record is the key, then its own number (8 bytes), then filler; the
+// number is what lets -c tell whether equal keys kept their order.
+
+#define RECORD 100
+#define KEY 4
+
+static uint64_t state = 88172645463325252ULL;
+
+static uint64_t next() {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+static int generate(size_t records, int bits, const char *name) {
+  FILE *f = fopen(name, "w");
+  if (f == NULL) {
+    perror(name);
+    return 1;
+  }
+  static char buf[RECORD * 1024];
+  uint32_t mask = bits >= 32 ? UINT32_MAX : (1u << bits) - 1;
+  for (size_t i = 0; i < records;) {
+    size_t k = 0;
+    for (; k < 1024 && i < records; k++, i++) {
+      char *r = buf + k * RECORD;
+      uint32_t key = next() & mask;
+      uint64_t num = i;
+      memcpy(r, &key, KEY);
+      memcpy(r + KEY, &num, 8);
+      for (int j = KEY + 8; j < RECORD; j += 8) {
+        uint64_t x = next();
+        memcpy(r + j, &x, RECORD - j < 8 ? RECORD - j : 8);
+      }
+    }
+    if (fwrite(buf, RECORD, k, f) != k) {
+      perror(name);
+      return 1;
+    }
+  }
+  return fclose(f) == 0 ? 0 : 1;
+}
+
+static const char *map(const char *name, size_t *size) {
+  int fd = open(name, O_RDONLY);
+  struct stat sb;
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    perror(name);
+    exit(1);
+  }
+  *size = sb.st_size;
+  if (*size == 0)
+    return NULL;
+  const char *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    perror(name);
+    exit(1);
+  }
+  madvise((void *)p, *size, MADV_SEQUENTIAL);
+  close(fd);
+  return p;
+}
+
+// order doesn't matter to a sum of hashes, so equal sums mean (almost
+// surely) the same records
+static uint64_t hash(const char *r) {
+  uint64_t h = 1469598103934665603ULL;
+  for (int i = 0; i < RECORD; i++)
+    h = (h ^ (unsigned char)r[i]) * 1099511628211ULL;
+  return h;
+}
+
+static int check(const char *input, const char *output) {
+  size_t isize, osize;
+  const char *ip = map(input, &isize), *op = map(output, &osize);
+  if (isize != osize || osize % RECORD != 0) {
+    fprintf(stderr, "gen: %s and %s differ in size\n", input, output);
+    return 1;
+  }
+  uint64_t isum = 0, osum = 0;
+  for (size_t i = 0; i < isize; i += RECORD) {
+    isum += hash(ip + i);
+    osum += hash(op + i);
+    if (i == 0)
+      continue;
+    uint32_t k0, k1;
+    uint64_t n0, n1;
+    memcpy(&k0, op + i - RECORD, KEY);
+    memcpy(&k1, op + i, KEY);
+    memcpy(&n0, op + i - RECORD + KEY, 8);
+    memcpy(&n1, op + i + KEY, 8);
+    if (k0 > k1 || (k0 == k1 && n0 > n1)) {
+      fprintf(stderr, "gen: %s out of order at record %zu\n", output,
+              i / RECORD);
+      return 1;
+    }
+  }
+  if (isum != osum) {
+    fprintf(stderr, "gen: %s does not hold the records of %s\n", output,
+            input);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 4 && strcmp(argv[1], "-c") == 0)
+    return check(argv[2], argv[3]);
+  int bits = 32;
+  if (argc == 5 && strcmp(argv[1], "-k") == 0) {
+    bits = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc != 3) {
+    printf("gen: [-k bits] records file | -c input output\n");
+    return 1;
+  }
+  return generate(strtoull(argv[1], NULL, 10), bits, argv[2]);
+}
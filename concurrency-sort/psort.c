@@ -0,0 +1,498 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+// Parallel sort of fixed-size records (see README.md): RECORD bytes each,
+// ordered by the KEY bytes at the front, read as an unsigned number in host
+// byte order.  Records with equal keys keep their input order.
+//
+// The records themselves are moved only once.  What gets sorted is an array
+// of 8-byte entries, each a key above the index of its record, in steps
+// that all run on every thread:
+//
+//   1. each thread takes a stretch of the input and makes its entries;
+//   2. it counts them by the highest key byte that is not the same in every
+//      record, which splits the entries into PARTS partitions;
+//   3. from everyone's counts, each thread knows where in the entry array
+//      its share of every partition goes, and moves its entries there;
+//   4. threads take partitions one at a time, as they come free, so a slow
+//      thread just sorts fewer, and radix sort each on the lower key bytes;
+//   5. threads take STRETCH entries at a time and copy the records they
+//      name into the output, which is a mapping of the output file.
+
+#define RECORD 100
+#define KEY 4
+#define PARTS 256
+#define SMALL 32        // partitions up to this size are insertion sorted
+#define STRETCH 16384   // entries copied out at a time in step 5
+
+static const char *in;  // the records to sort
+static char *out;       // where they go, in order
+static size_t n;        // how many there are
+static int nthreads;
+static uint64_t *a, *b; // the entries, and as much room again to sort them
+
+static uint32_t varies;          // key bits that differ between records
+static size_t (*counts)[PARTS];  // per thread: entries in each partition
+static size_t starts[PARTS + 1]; // where each partition begins in a
+static long next_part, next_stretch;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t barrier;
+
+// hands out 0, 1, ..., limit - 1 across the threads, then -1
+static long take(long *next, long limit) {
+  pthread_mutex_lock(&lock);
+  long i = (*next)++;
+  pthread_mutex_unlock(&lock);
+  return i < limit ? i : -1;
+}
+
+// Sorts the len entries at x on their lowest passes key bytes, using y as
+// room to do it in.  The result is at y if passes is odd, else at x.
+static void sort_part(uint64_t *x, uint64_t *y, size_t len, int passes) {
+  if (len <= SMALL) {
+    // equal keys are in index order, so whole entries compare the same
+    for (size_t i = 1; i < len; i++) {
+      uint64_t e = x[i];
+      size_t j = i;
+      for (; j > 0 && x[j - 1] > e; j--)
+        x[j] = x[j - 1];
+      x[j] = e;
+    }
+    if (passes % 2)
+      memcpy(y, x, len * sizeof(uint64_t));
+    return;
+  }
+  for (int pass = 0; pass < passes; pass++) {
+    int shift = 32 + 8 * pass;
+    size_t count[256] = {0};
+    for (size_t i = 0; i < len; i++)
+      count[(x[i] >> shift) & 255]++;
+    for (size_t d = 0, pos = 0; d < 256; d++) {
+      size_t c = count[d];
+      count[d] = pos;
+      pos += c;
+    }
+    for (size_t i = 0; i < len; i++)
+      y[count[(x[i] >> shift) & 255]++] = x[i];
+    uint64_t *t = x;
+    x = y;
+    y = t;
+  }
+}
+
+static void *worker(void *arg) {
+  long t = (long)arg;
+  size_t lo = n * t / nthreads, hi = n * (t + 1) / nthreads;
+
+  // 1
+  uint32_t first, diff = 0;
+  memcpy(&first, in, KEY);
+  for (size_t i = lo; i < hi; i++) {
+    uint32_t key;
+    memcpy(&key, in + i * RECORD, KEY);
+    diff |= key ^ first;
+    b[i] = (uint64_t)key << 32 | i;
+  }
+  pthread_mutex_lock(&lock);
+  varies |= diff;
+  pthread_mutex_unlock(&lock);
+  pthread_barrier_wait(&barrier);
+
+  // 2: bytes above the one partitioned on are the same everywhere, and
+  // the ones below are left for step 4
+  int passes = varies ? (31 - __builtin_clz(varies)) / 8 : 0;
+  int shift = 32 + 8 * passes;
+  size_t *count = counts[t];
+  memset(count, 0, sizeof(counts[t]));
+  for (size_t i = lo; i < hi; i++)
+    count[(b[i] >> shift) & 255]++;
+  pthread_barrier_wait(&barrier);
+
+  // 3: threads' shares follow each other in thread order, which keeps
+  // equal keys in input order
+  if (t == 0) {
+    size_t pos = 0;
+    for (int p = 0; p < PARTS; p++) {
+      starts[p] = pos;
+      for (int u = 0; u < nthreads; u++) {
+        size_t c = counts[u][p];
+        counts[u][p] = pos;
+        pos += c;
+      }
+    }
+    starts[PARTS] = pos;
+  }
+  pthread_barrier_wait(&barrier);
+  for (size_t i = lo; i < hi; i++)
+    a[count[(b[i] >> shift) & 255]++] = b[i];
+  pthread_barrier_wait(&barrier);
+
+  // 4
+  long p;
+  while ((p = take(&next_part, PARTS)) >= 0)
+    sort_part(a + starts[p], b + starts[p], starts[p + 1] - starts[p], passes);
+  pthread_barrier_wait(&barrier);
+
+  // 5
+  const uint64_t *sorted = passes % 2 ? b : a;
+  long s;
+  while ((s = take(&next_stretch, (n + STRETCH - 1) / STRETCH)) >= 0) {
+    size_t end = (s + 1) * STRETCH < n ? (s + 1) * STRETCH : n;
+    for (size_t i = s * STRETCH; i < end; i++)
+      // the index is 32 bits but its offset is not: past 42,949,672
+      // records, a 32-bit product would wrap
+      memcpy(out + i * RECORD, in + (size_t)(uint32_t)sorted[i] * RECORD,
+             RECORD);
+  }
+  return NULL;
+}
+
+// sorts the count records at from into to; returns -1 if out of memory
+static int sort_records(const char *from, size_t count, char *to) {
+  if (count == 0)
+    return 0;
+  in = from;
+  out = to;
+  n = count;
+  nthreads = get_nprocs();
+  a = malloc(n * sizeof(uint64_t));
+  b = malloc(n * sizeof(uint64_t));
+  counts = malloc(nthreads * sizeof(counts[0]));
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  if (a == NULL || b == NULL || counts == NULL || threads == NULL)
+    return -1;
+  varies = 0;
+  next_part = next_stretch = 0;
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  for (long i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)i);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&barrier);
+  free(a);
+  free(b);
+  free(counts);
+  free(threads);
+  return 0;
+}
+
+// the sort as the README describes it: both files mapped, one pass
+static int sort_in_memory(int fd, size_t size, int ofd) {
+  if (size == 0)
+    return 0;
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return -1;
+  madvise((void *)data, size, MADV_WILLNEED);
+
+  // the output is laid out at its full size, and the threads fill it in
+  if (ftruncate(ofd, size) < 0)
+    return -1;
+  char *sorted = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+  if (sorted == MAP_FAILED || sort_records(data, size / RECORD, sorted) < 0)
+    return -1;
+  munmap(sorted, size);
+  munmap((void *)data, size);
+  return 0;
+}
+
+// For input that the memory budget cannot sort at once, an external sort.
+//
+// Pass one cuts the input into runs of as many records as the budget can
+// hold (COST bytes each: the records, a sorted copy, two entries), sorts
+// each with sort_records() and writes it, in one piece, to a temporary file
+// next to the output.
+//
+// Pass two merges the runs with a loser tree.  Each inner node of the tree
+// holds the run that lost the match played there, and the root the overall
+// winner, so once a record has been taken from the winning run only the
+// matches on its way up are played again: log2(runs) comparisons a record.
+// Every run is read through two buffers; while the merge takes records
+// from one, an I/O thread fills the other from further on in the run.  The
+// output goes out the same way, one buffer being written as the other
+// fills.  All the buffers together take up the budget.
+
+#define COST (2 * RECORD + 2 * sizeof(uint64_t))
+
+typedef struct io {
+  int write; // pwrite() this, rather than pread()
+  int fd;
+  char *buf;
+  size_t len;
+  off_t off;
+  int done;
+  struct io *next;
+} io_t;
+
+typedef struct {
+  off_t next, end; // what of the run is still to be read ahead
+  char *buf[2];
+  io_t io[2];
+  int cur;    // the buffer the merge is taking records from
+  size_t pos; // and where it is in it
+} run_t;
+
+static io_t *queue, **queue_end = &queue; // for the I/O thread, in order
+static int stopping, io_failed;
+static pthread_cond_t io_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;
+
+static int full_io(int write, int fd, char *buf, size_t len, off_t off) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write ? pwrite(fd, buf + done, len - done, off + done)
+                      : pread(fd, buf + done, len - done, off + done);
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+static void *io_thread(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (queue == NULL && !stopping)
+      pthread_cond_wait(&io_queued, &lock);
+    io_t *r = queue;
+    if (r == NULL)
+      break;
+    if ((queue = r->next) == NULL)
+      queue_end = &queue;
+    pthread_mutex_unlock(&lock);
+    int failed = full_io(r->write, r->fd, r->buf, r->len, r->off) < 0;
+    pthread_mutex_lock(&lock);
+    io_failed |= failed;
+    r->done = 1;
+    pthread_cond_broadcast(&io_done);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+static void submit(io_t *r, int write, int fd, char *buf, size_t len,
+                   off_t off) {
+  r->write = write;
+  r->fd = fd;
+  r->buf = buf;
+  r->len = len;
+  r->off = off;
+  r->done = 0;
+  r->next = NULL;
+  pthread_mutex_lock(&lock);
+  *queue_end = r;
+  queue_end = &r->next;
+  pthread_cond_signal(&io_queued);
+  pthread_mutex_unlock(&lock);
+}
+
+static void wait_for(io_t *r) {
+  pthread_mutex_lock(&lock);
+  while (!r->done)
+    pthread_cond_wait(&io_done, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+// starts filling buffer i of run r with what comes next in the run
+static void read_ahead(run_t *r, int i, int fd, size_t bufsize) {
+  size_t len = r->end - r->next < bufsize ? r->end - r->next : bufsize;
+  if (len == 0) {
+    r->io[i].len = 0;
+    r->io[i].done = 1;
+    return;
+  }
+  submit(&r->io[i], 0, fd, r->buf[i], len, r->next);
+  r->next += len;
+}
+
+// what run i puts up for the next match: its key, then the run, so that
+// equal keys go out in input order; or more than any of those once the
+// run is finished
+static uint64_t head(run_t *r, long i, int fd, size_t bufsize) {
+  if (r->pos == r->io[r->cur].len) {
+    read_ahead(r, r->cur, fd, bufsize);
+    r->cur ^= 1;
+    r->pos = 0;
+    wait_for(&r->io[r->cur]);
+    if (r->io[r->cur].len == 0)
+      return UINT64_MAX;
+  }
+  uint32_t key;
+  memcpy(&key, r->buf[r->cur] + r->pos, KEY);
+  return (uint64_t)key << 32 | i;
+}
+
+// Plays the matches below node t of a tree over k runs, leaving the loser
+// of each in its node; returns the winner.  Runs are the leaves k .. 2k - 1.
+static int play(int *tree, const uint64_t *heads, int k, int t) {
+  if (t >= k)
+    return t - k;
+  int x = play(tree, heads, k, 2 * t), y = play(tree, heads, k, 2 * t + 1);
+  tree[t] = heads[x] < heads[y] ? y : x;
+  return heads[x] < heads[y] ? x : y;
+}
+
+static int sort_external(int fd, size_t size, int ofd, const char *output,
+                         size_t budget) {
+  size_t total = size / RECORD, per_run = budget / COST;
+  if (per_run == 0)
+    per_run = 1;
+  if (per_run > UINT32_MAX)
+    per_run = UINT32_MAX;
+  int k = (total + per_run - 1) / per_run;
+
+  // pass one
+  char *name = malloc(strlen(output) + 8);
+  if (name == NULL)
+    return -1;
+  sprintf(name, "%s.XXXXXX", output);
+  int tfd = mkstemp(name);
+  if (tfd < 0)
+    return -1;
+  unlink(name);
+  free(name);
+  char *raw = malloc(per_run * RECORD), *sorted = malloc(per_run * RECORD);
+  if (raw == NULL || sorted == NULL)
+    return -1;
+  for (size_t first = 0; first < total; first += per_run) {
+    size_t count = total - first < per_run ? total - first : per_run;
+    off_t off = first * RECORD;
+    if (full_io(0, fd, raw, count * RECORD, off) < 0 ||
+        sort_records(raw, count, sorted) < 0 ||
+        full_io(1, tfd, sorted, count * RECORD, off) < 0)
+      return -1;
+  }
+  free(raw);
+  free(sorted);
+
+  // pass two
+  size_t bufsize = budget / (2 * k + 2) / RECORD * RECORD;
+  if (bufsize < RECORD)
+    bufsize = RECORD;
+  run_t *runs = calloc(k, sizeof(run_t));
+  int *tree = malloc(k * sizeof(int));
+  uint64_t *heads = malloc(k * sizeof(uint64_t));
+  char *obuf[2] = {malloc(bufsize), malloc(bufsize)};
+  io_t oio[2] = {{.done = 1}, {.done = 1}};
+  if (runs == NULL || tree == NULL || heads == NULL || obuf[0] == NULL ||
+      obuf[1] == NULL)
+    return -1;
+  pthread_t io;
+  pthread_create(&io, NULL, io_thread, NULL);
+
+  for (long i = 0; i < k; i++) {
+    run_t *r = &runs[i];
+    r->next = i * per_run * RECORD;
+    r->end = i == k - 1 ? size : r->next + per_run * RECORD;
+    for (int j = 0; j < 2; j++) {
+      if ((r->buf[j] = malloc(bufsize)) == NULL)
+        return -1;
+      read_ahead(r, j, tfd, bufsize);
+    }
+    wait_for(&r->io[0]);
+    heads[i] = head(r, i, tfd, bufsize);
+  }
+  tree[0] = play(tree, heads, k, 1);
+
+  int cur = 0;
+  size_t pos = 0;
+  off_t written = 0;
+  while (heads[tree[0]] != UINT64_MAX) {
+    int w = tree[0];
+    run_t *r = &runs[w];
+    memcpy(obuf[cur] + pos, r->buf[r->cur] + r->pos, RECORD);
+    r->pos += RECORD;
+    if ((pos += RECORD) == bufsize) {
+      submit(&oio[cur], 1, ofd, obuf[cur], pos, written);
+      written += pos;
+      cur ^= 1;
+      wait_for(&oio[cur]);
+      pos = 0;
+    }
+    // only the matches on w's way up can come out differently
+    heads[w] = head(r, w, tfd, bufsize);
+    for (int t = (w + k) / 2; t > 0; t /= 2) {
+      if (heads[tree[t]] < heads[w]) {
+        int loser = w;
+        w = tree[t];
+        tree[t] = loser;
+      }
+    }
+    tree[0] = w;
+  }
+  if (pos > 0)
+    submit(&oio[cur], 1, ofd, obuf[cur], pos, written);
+  wait_for(&oio[0]);
+  wait_for(&oio[1]);
+
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_signal(&io_queued);
+  pthread_mutex_unlock(&lock);
+  pthread_join(io, NULL);
+  close(tfd);
+  for (int i = 0; i < k; i++) {
+    free(runs[i].buf[0]);
+    free(runs[i].buf[1]);
+  }
+  free(runs);
+  free(tree);
+  free(heads);
+  free(obuf[0]);
+  free(obuf[1]);
+  return io_failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  // unless told otherwise, half of the machine's memory
+  size_t budget = get_phys_pages() * sysconf(_SC_PAGESIZE) / 2;
+  int first = 1;
+  if (argc == 5 && strcmp(argv[1], "-m") == 0) {
+    budget = strtoull(argv[2], NULL, 10) << 20;
+    first = 3;
+  }
+  if (argc != first + 2) {
+    printf("psort: [-m megabytes] input output\n");
+    return 1;
+  }
+  const char *input = argv[first], *output = argv[first + 1];
+
+  int fd = open(input, O_RDONLY);
+  struct stat sb;
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    perror(input);
+    return 1;
+  }
+  size_t size = sb.st_size;
+  if (size % RECORD != 0) {
+    fprintf(stderr, "psort: %s: not a whole number of records\n", input);
+    return 1;
+  }
+  int ofd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (ofd < 0) {
+    perror(output);
+    return 1;
+  }
+
+  size_t records = size / RECORD;
+  int rc = records * COST <= budget && records <= UINT32_MAX
+               ? sort_in_memory(fd, size, ofd)
+               : sort_external(fd, size, ofd, output, budget);
+  if (rc < 0) {
+    perror("psort");
+    return 1;
+  }
+  close(fd);
+  if (fsync(ofd) < 0 || close(ofd) < 0) {
+    perror(output);
+    return 1;
+  }
+  return 0;
+}
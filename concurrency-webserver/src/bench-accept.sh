@@ -0,0 +1,42 @@
+#! /bin/bash
+#
+# Accept-rate scaling of the SO_REUSEPORT listeners (wserver -l N).
+#
+# For N = 1, 2, 4, ... up to the number of cores, starts the server with N
+# listeners and runs one `wclient -x` per core, each opening a fresh
+# connection for every request, and reports the combined request rate.
+#
+# usage: ./bench-accept.sh [port] [requests-per-client]
+
+port=${1:-10007}
+requests=${2:-5000}
+cores=$(nproc)
+
+if ! [[ -x wserver && -x wclient ]]; then
+    echo "run make first"
+    exit 1
+fi
+
+root=$(mktemp -d)
+echo hello > $root/hello.txt
+trap 'rm -rf $root' EXIT
+
+n=1
+while (( n <= cores )); do
+    ./wserver -d $root -p $port -l $n > /dev/null &
+    server=$!
+    sleep 0.5
+
+    start=$(date +%s.%N)
+    for (( i = 0; i < cores; i++ )); do
+	./wclient -q -x -n $requests localhost $port /hello.txt > /dev/null &
+    done
+    wait $(jobs -p | grep -v "^$server\$")
+    end=$(date +%s.%N)
+
+    kill $server
+    wait $server 2> /dev/null
+    awk -v n=$n -v c=$cores -v r=$requests -v s=$start -v e=$end \
+	'BEGIN { printf "listeners %d: %.0f connections/s\n", n, c * r / (e - s) }'
+    (( n = n * 2 ))
+done
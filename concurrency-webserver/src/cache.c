@@ -0,0 +1,245 @@
+#include <time.h>
+#include "io_helper.h"
+#include "cache.h"
+
+#define CACHE_BUCKETS (1024)
+
+static cache_entry_t *table[CACHE_BUCKETS];
+static cache_entry_t *lru_head, *lru_tail;
+static cache_stats_t stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static unsigned int hash_path(char *path, int encoding) {
+    unsigned int hash = 5381 + encoding;
+    int c;
+    while ((c = *path++) != '\0')
+	hash = hash * 33 + c;
+    return hash % CACHE_BUCKETS;
+}
+
+void cache_init(size_t budget) {
+    stats.budget = budget;
+}
+
+int cache_enabled() {
+    return stats.budget > 0;
+}
+
+int cache_admit(off_t filesize) {
+    // one file may not take more than an eighth of the budget
+    return cache_enabled() && filesize <= stats.budget / 8;
+}
+
+static void entry_free(cache_entry_t *e) {
+    free(e->path);
+    free(e->source);
+    free(e->data);
+    free(e);
+}
+
+// caller holds lock
+static void entry_unref(cache_entry_t *e) {
+    if (--e->refs == 0)
+	entry_free(e);
+}
+
+// caller holds lock
+static void lru_unlink(cache_entry_t *e) {
+    if (e->lru_prev)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	lru_head = e->lru_next;
+    if (e->lru_next)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+// caller holds lock
+static void lru_push_front(cache_entry_t *e) {
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if (lru_head)
+	lru_head->lru_prev = e;
+    lru_head = e;
+    if (lru_tail == NULL)
+	lru_tail = e;
+}
+
+// take e out of the table and drop the cache's reference; caller holds lock
+static void entry_remove(cache_entry_t *e) {
+    cache_entry_t **pp = &table[hash_path(e->path, e->encoding)];
+    while (*pp != e)
+	pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(e);
+    e->cached = 0;
+    stats.entries--;
+    stats.bytes -= e->size;
+    entry_unref(e);
+}
+
+// caller holds lock
+static cache_entry_t *entry_find(char *path, int encoding) {
+    cache_entry_t *e;
+    for (e = table[hash_path(path, encoding)]; e != NULL; e = e->hnext)
+	if (e->encoding == encoding && strcmp(e->path, path) == 0)
+	    return e;
+    return NULL;
+}
+
+static int entry_matches(cache_entry_t *e, struct stat *sbuf) {
+    return e->dev == sbuf->st_dev && e->ino == sbuf->st_ino &&
+	e->filesize == sbuf->st_size &&
+	e->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+	e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+}
+
+// is a newer than b?
+static int mtime_after(struct timespec a, struct timespec b) {
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+cache_entry_t *cache_lookup(char *path, int encoding) {
+    if (!cache_enabled())
+	return NULL;
+    
+    assert(pthread_mutex_lock(&lock) == 0);
+    cache_entry_t *e = entry_find(path, encoding);
+    if (e == NULL) {
+	stats.misses++;
+	assert(pthread_mutex_unlock(&lock) == 0);
+	return NULL;
+    }
+    e->refs++;
+    double now = now_seconds();
+    int validate = now - e->checked >= CACHE_VALIDATE_SECS;
+    assert(pthread_mutex_unlock(&lock) == 0);
+    
+    // stat() without holding the lock; another thread may revalidate (or
+    // drop) the same entry meanwhile, which is harmless
+    int fresh = 1;
+    if (validate) {
+	struct stat sbuf;
+	fresh = stat(e->source, &sbuf) == 0 && entry_matches(e, &sbuf);
+	// a .gz file next to the original goes stale when the original is
+	// changed after it, even though the .gz file itself is untouched
+	if (fresh && strcmp(e->source, e->path) != 0)
+	    fresh = stat(e->path, &sbuf) == 0 && !mtime_after(sbuf.st_mtim, e->mtime);
+    }
+    
+    assert(pthread_mutex_lock(&lock) == 0);
+    if (!fresh) {
+	stats.stale++;
+	stats.misses++;
+	if (e->cached)
+	    entry_remove(e);
+	entry_unref(e);
+	e = NULL;
+    } else {
+	stats.hits++;
+	if (validate)
+	    e->checked = now;
+	if (e->cached && e != lru_head) {
+	    lru_unlink(e);
+	    lru_push_front(e);
+	}
+    }
+    assert(pthread_mutex_unlock(&lock) == 0);
+    return e;
+}
+
+// fills in everything but data and size, and adds e; returns e referenced
+static cache_entry_t *entry_add(cache_entry_t *e, char *path, int encoding, char *source,
+				struct stat *sbuf, int hdrlen) {
+    e->path = strdup(path);
+    e->source = strdup(source);
+    assert(e->path != NULL && e->source != NULL);
+    e->encoding = encoding;
+    e->hdrlen = hdrlen;
+    e->dev = sbuf->st_dev;
+    e->ino = sbuf->st_ino;
+    e->mtime = sbuf->st_mtim;
+    e->filesize = sbuf->st_size;
+    e->checked = now_seconds();
+    e->refs = 2; // the table's, and the caller's
+    e->cached = 1;
+    e->lru_prev = e->lru_next = NULL;
+    
+    assert(pthread_mutex_lock(&lock) == 0);
+    // another thread may have raced us in for the same file
+    cache_entry_t *old = entry_find(path, encoding);
+    if (old != NULL)
+	entry_remove(old);
+    while (lru_tail != NULL && stats.bytes + e->size > stats.budget) {
+	entry_remove(lru_tail);
+	stats.evictions++;
+    }
+    unsigned int b = hash_path(path, encoding);
+    e->hnext = table[b];
+    table[b] = e;
+    lru_push_front(e);
+    stats.entries++;
+    stats.bytes += e->size;
+    stats.inserts++;
+    assert(pthread_mutex_unlock(&lock) == 0);
+    return e;
+}
+
+cache_entry_t *cache_insert(char *path, int encoding, char *source, struct stat *sbuf,
+			    char *hdr, int hdrlen, int srcfd) {
+    size_t filesize = sbuf->st_size;
+    cache_entry_t *e = malloc(sizeof(cache_entry_t));
+    assert(e != NULL);
+    e->data = malloc(hdrlen + filesize);
+    assert(e->data != NULL);
+    
+    // fill the entry before taking the lock
+    memcpy(e->data, hdr, hdrlen);
+    size_t n = 0;
+    while (n < filesize) {
+	ssize_t rc = read_or_die(srcfd, e->data + hdrlen + n, filesize - n);
+	if (rc == 0)
+	    break;
+	n += rc;
+    }
+    if (n != filesize) {
+	// file changed while we were reading it; do not cache a torn copy
+	free(e->data);
+	free(e);
+	return NULL;
+    }
+    e->size = hdrlen + filesize;
+    return entry_add(e, path, encoding, source, sbuf, hdrlen);
+}
+
+cache_entry_t *cache_insert_data(char *path, int encoding, char *source, struct stat *sbuf,
+				 char *hdr, int hdrlen, char *body, size_t bodylen) {
+    cache_entry_t *e = malloc(sizeof(cache_entry_t));
+    assert(e != NULL);
+    e->data = malloc(hdrlen + bodylen);
+    assert(e->data != NULL);
+    memcpy(e->data, hdr, hdrlen);
+    memcpy(e->data + hdrlen, body, bodylen);
+    e->size = hdrlen + bodylen;
+    return entry_add(e, path, encoding, source, sbuf, hdrlen);
+}
+
+void cache_release(cache_entry_t *e) {
+    assert(pthread_mutex_lock(&lock) == 0);
+    entry_unref(e);
+    assert(pthread_mutex_unlock(&lock) == 0);
+}
+
+void cache_get_stats(cache_stats_t *s) {
+    assert(pthread_mutex_lock(&lock) == 0);
+    *s = stats;
+    assert(pthread_mutex_unlock(&lock) == 0);
+}
@@ -0,0 +1,88 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+//
+// In-memory cache of static responses, keyed by file name and content
+// encoding.
+//
+// Each entry holds the preformatted response header immediately followed
+// by the file body, so a hit is a single write from memory.  Entries are
+// revalidated against the file's inode and mtime at most once every
+// CACHE_VALIDATE_SECS; between validations a hit does not touch the file
+// system at all.  Total size is bounded by a byte budget, and the least
+// recently used entries are evicted to make room.  Entries are reference
+// counted, so an entry evicted while another thread is still sending it is
+// freed only when that thread releases it.
+//
+// An encoded entry (gzip) is validated against the file it was made from:
+// the .gz file next to the original if that is what it holds, otherwise
+// the original, so a compressed copy is thrown away as soon as its source
+// changes.  One made from a .gz file is also thrown away once the original
+// is newer than the .gz file, which is then out of date.
+//
+
+#define CACHE_VALIDATE_SECS (1.0)
+
+#define CACHE_IDENTITY (0)
+#define CACHE_GZIP     (1)
+
+typedef struct cache_entry {
+    char *path;
+    int encoding;           // CACHE_IDENTITY or CACHE_GZIP
+    char *source;           // the file stat'd to validate the entry
+    char *data;             // header, then body
+    int hdrlen;
+    size_t size;            // hdrlen + body length
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t filesize;
+    double checked;         // when the file was last stat'd
+    int refs;               // the cache's own reference + active senders
+    int cached;             // still reachable from the table?
+    struct cache_entry *hnext;              // hash chain
+    struct cache_entry *lru_prev, *lru_next; // head is most recently used
+} cache_entry_t;
+
+typedef struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;       // lookups that found an out-of-date entry
+    unsigned long inserts;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+    size_t budget;
+} cache_stats_t;
+
+// budget of 0 disables the cache; lookups then always miss
+void cache_init(size_t budget);
+int cache_enabled();
+
+// is a file of this size worth caching?
+int cache_admit(off_t filesize);
+
+// returns a referenced entry, or NULL on a miss
+cache_entry_t *cache_lookup(char *path, int encoding);
+
+// reads the size in sbuf of bytes from srcfd, which is source, behind a
+// copy of hdr and adds the result; returns a referenced entry, or NULL if
+// the file could not be read whole
+cache_entry_t *cache_insert(char *path, int encoding, char *source, struct stat *sbuf,
+			    char *hdr, int hdrlen, int srcfd);
+
+// adds a copy of hdr and body, made from source as it was in sbuf; returns
+// a referenced entry
+cache_entry_t *cache_insert_data(char *path, int encoding, char *source, struct stat *sbuf,
+				 char *hdr, int hdrlen, char *body, size_t bodylen);
+
+// drop the reference returned by cache_lookup()/cache_insert()
+void cache_release(cache_entry_t *e);
+
+void cache_get_stats(cache_stats_t *stats);
+
+#endif // __CACHE_H__
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE // close_range()
+#include <pthread.h>
+#include "io_helper.h"
+#include "cgi_pool.h"
+#include "stats.h"
+
+#define MAXBUF (8192)
+#define MAX_PROGRAMS (16)
+#define RETRY_MIN (1.0)   // seconds to run a program the old way after it
+#define RETRY_MAX (60.0)  // failed to start, doubling with each failure
+
+int cgi_pool_size = 0;
+int cgi_pool_timeout = 30000;
+
+typedef struct worker {
+    pid_t pid;
+    int fd;                 // our end of the socket pair; -1 if not running
+    int busy;
+    int served;
+} worker_t;
+
+typedef struct program {
+    char *filename;
+    int unsupported;        // decided for the file as of mtime
+    struct timespec mtime;
+    double retry_at;        // after a failed start, the old way until then
+    double retry_wait;
+    worker_t *workers;
+    pthread_cond_t idle;
+} program_t;
+
+static program_t programs[MAX_PROGRAMS];
+static int nprograms;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// reads exactly len bytes, giving up after timeout_ms of silence
+static int read_full(int fd, void *buf, int len, int timeout_ms) {
+    char *p = buf;
+    while (len > 0) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+	    return -1;
+	int rc = read(fd, p, len);
+	if (rc <= 0)
+	    return -1;
+	p += rc;
+	len -= rc;
+    }
+    return 0;
+}
+
+static int write_full(int fd, void *buf, int len) {
+    char *p = buf;
+    while (len > 0) {
+	// a dead worker must not take the server down with SIGPIPE
+	int rc = send(fd, p, len, MSG_NOSIGNAL);
+	if (rc <= 0)
+	    return -1;
+	p += rc;
+	len -= rc;
+    }
+    return 0;
+}
+
+static void worker_stop(worker_t *w) {
+    if (w->fd < 0)
+	return;
+    close_or_die(w->fd);
+    kill(w->pid, SIGKILL);
+    waitpid(w->pid, NULL, 0);
+    w->fd = -1;
+}
+
+// returns 0 once the worker has greeted us, -2 if it declined, and -1 if it
+// failed in some other way (which may not happen next time)
+static int worker_start(program_t *p, worker_t *w) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    pid_t pid = fork_or_die();
+    if (pid == 0) {                              // child
+	close_or_die(sv[0]);
+	dup2_or_die(sv[1], STDIN_FILENO);
+	dup2_or_die(sv[1], STDOUT_FILENO);
+	// the worker outlives this request, so it must not hold the client's
+	// socket (or the listening socket) open
+	close_range(STDERR_FILENO + 1, ~0U, 0);
+	setenv_or_die(CGI_POOL_ENV, "1", 1);
+	char *argv[] = { NULL };
+	extern char **environ;
+	execve_or_die(p->filename, argv, environ);
+    }
+    close_or_die(sv[1]);
+    // keep the server's end out of CGI programs forked later
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    w->pid = pid;
+    w->fd = sv[0];
+    w->served = 0;
+    
+    unsigned int magic = 0;
+    if (read_full(w->fd, &magic, sizeof(magic), cgi_pool_timeout) < 0 || magic != CGI_POOL_MAGIC) {
+	worker_stop(w);
+	return magic == CGI_POOL_DECLINE ? -2 : -1;
+    }
+    return 0;
+}
+
+// Decides whether the program is worth starting as a worker at all: one
+// that never mentions CGI_POOL_ENV cannot know about the pool, and is not
+// run an extra time just to find that out.  Caller holds lock.
+static void program_check(program_t *p) {
+    struct stat sb;
+    if (stat(p->filename, &sb) < 0) {
+	p->unsupported = 1;
+	return;
+    }
+    if (sb.st_mtim.tv_sec == p->mtime.tv_sec && sb.st_mtim.tv_nsec == p->mtime.tv_nsec)
+	return; // same file as last time, same answer
+    p->mtime = sb.st_mtim;
+    p->retry_at = p->retry_wait = 0;
+    p->unsupported = 1;
+    int fd = open(p->filename, O_RDONLY);
+    if (fd < 0)
+	return;
+    if (sb.st_size > 0) {
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED) {
+	    p->unsupported = memmem(map, sb.st_size, CGI_POOL_ENV, strlen(CGI_POOL_ENV)) == NULL;
+	    munmap(map, sb.st_size);
+	}
+    }
+    close_or_die(fd);
+}
+
+// caller holds lock
+static program_t *program_find(char *filename) {
+    for (int i = 0; i < nprograms; i++)
+	if (strcmp(programs[i].filename, filename) == 0)
+	    return &programs[i];
+    if (nprograms == MAX_PROGRAMS)
+	return NULL;
+    program_t *p = &programs[nprograms++];
+    p->filename = strdup(filename);
+    assert(p->filename != NULL);
+    p->mtime = (struct timespec) { 0, 0 };
+    p->workers = malloc(cgi_pool_size * sizeof(worker_t));
+    assert(p->workers != NULL);
+    for (int i = 0; i < cgi_pool_size; i++) {
+	p->workers[i].fd = -1;
+	p->workers[i].busy = 0;
+    }
+    assert(pthread_cond_init(&p->idle, NULL) == 0);
+    return p;
+}
+
+// caller holds lock; waits for a worker to be free and marks it busy
+static worker_t *worker_acquire(program_t *p) {
+    while (1) {
+	for (int i = 0; i < cgi_pool_size; i++) {
+	    if (!p->workers[i].busy) {
+		p->workers[i].busy = 1;
+		return &p->workers[i];
+	    }
+	}
+	assert(pthread_cond_wait(&p->idle, &lock) == 0);
+    }
+}
+
+static void worker_release(program_t *p, worker_t *w) {
+    assert(pthread_mutex_lock(&lock) == 0);
+    w->busy = 0;
+    assert(pthread_cond_signal(&p->idle) == 0);
+    assert(pthread_mutex_unlock(&lock) == 0);
+}
+
+//
+// Runs one request on w, copying the program's output to fd.  Returns 0 on
+// success, -1 if the worker failed before anything was sent to fd, and -2
+// if it failed partway through (the client then sees a short response).
+//
+static int worker_request(worker_t *w, int fd, char *cgiargs, char *header) {
+    unsigned int len = strlen(cgiargs);
+    if (write_full(w->fd, &len, sizeof(len)) < 0 || write_full(w->fd, cgiargs, len) < 0)
+	return -1;
+    if (read_full(w->fd, &len, sizeof(len), cgi_pool_timeout) < 0)
+	return -1;
+    
+    // if the client goes away, the rest of the reply is still read, so that
+    // the worker is left ready for its next request
+    int client_ok = write_full(fd, header, strlen(header)) == 0;
+    char buf[MAXBUF];
+    while (len > 0) {
+	int n = len < MAXBUF ? len : MAXBUF;
+	if (read_full(w->fd, buf, n, cgi_pool_timeout) < 0)
+	    return -2;
+	if (client_ok && write_full(fd, buf, n) < 0)
+	    client_ok = 0;
+	len -= n;
+    }
+    w->served++;
+    return 0;
+}
+
+int cgi_pool_run(int fd, char *filename, char *cgiargs, char *header) {
+    if (cgi_pool_size <= 0)
+	return CGI_POOL_UNSUPPORTED;
+    
+    assert(pthread_mutex_lock(&lock) == 0);
+    program_t *p = program_find(filename);
+    if (p != NULL)
+	program_check(p);
+    if (p == NULL || p->unsupported || stats_now() < p->retry_at) {
+	assert(pthread_mutex_unlock(&lock) == 0);
+	return CGI_POOL_UNSUPPORTED;
+    }
+    worker_t *w = worker_acquire(p);
+    assert(pthread_mutex_unlock(&lock) == 0);
+    
+    // from here on, w belongs to this thread alone
+    if (w->fd < 0) {
+	int rc = worker_start(p, w);
+	assert(pthread_mutex_lock(&lock) == 0);
+	if (rc == -2) {
+	    p->unsupported = 1; // until the file changes
+	} else if (rc == -1) {
+	    // a timeout or a crash says nothing for certain about the program,
+	    // so it gets another chance, though not on every request
+	    p->retry_wait = p->retry_wait == 0 ? RETRY_MIN : p->retry_wait * 2;
+	    if (p->retry_wait > RETRY_MAX)
+		p->retry_wait = RETRY_MAX;
+	    p->retry_at = stats_now() + p->retry_wait;
+	} else {
+	    p->retry_wait = 0;
+	}
+	assert(pthread_mutex_unlock(&lock) == 0);
+	if (rc < 0) {
+	    worker_release(p, w);
+	    return CGI_POOL_UNSUPPORTED;
+	}
+    }
+    
+    int rc = worker_request(w, fd, cgiargs, header);
+    if (rc < 0 || w->served >= CGI_POOL_MAX_REQUESTS)
+	worker_stop(w); // it will be restarted by the next request to get it
+    worker_release(p, w);
+    return rc == -1 ? CGI_POOL_FAILED : CGI_POOL_DONE;
+}
@@ -0,0 +1,43 @@
+#ifndef __CGI_POOL_H__
+#define __CGI_POOL_H__
+
+//
+// Pool of long-lived CGI processes (a much simplified FastCGI).
+//
+// Rather than fork and exec the program for every request, the server
+// starts up to cgi_pool_size copies of each program, with
+// OSTEP_CGI_PERSISTENT=1 in their environment and one end of a Unix socket
+// pair as their stdin and stdout.  A persistent program first writes the
+// 4-byte CGI_POOL_MAGIC, then loops: read a request, which is a 4-byte
+// length and that many bytes of query string, and answer with a 4-byte
+// length and that many bytes of CGI output (remaining headers and body).
+//
+// A worker that does not answer within cgi_pool_timeout ms, or that exits,
+// is killed and replaced; a worker is also replaced after serving
+// CGI_POOL_MAX_REQUESTS requests.
+//
+// Programs run the old way, one fork per request, if they never mention
+// OSTEP_CGI_PERSISTENT (the file is searched for the name; it is not run to
+// find out), or if they answer the environment variable with
+// CGI_POOL_DECLINE rather than the magic; either verdict lasts until the
+// file changes.  A program that fails to start in any other way is run the
+// old way for a while, then tried again.
+//
+
+#define CGI_POOL_MAGIC        (0x4f434749) // "OCGI"
+#define CGI_POOL_DECLINE      (0x4e434749) // "NCGI"
+#define CGI_POOL_ENV          "OSTEP_CGI_PERSISTENT"
+#define CGI_POOL_MAX_REQUESTS (10000)
+
+extern int cgi_pool_size;     // workers per program; 0 disables the pool
+extern int cgi_pool_timeout;  // ms
+
+// return values of cgi_pool_run()
+#define CGI_POOL_DONE        (0)  // response written to fd
+#define CGI_POOL_UNSUPPORTED (1)  // program cannot run persistently
+#define CGI_POOL_FAILED      (2)  // worker died or timed out; nothing written
+
+// header is written to fd ahead of the program's output
+int cgi_pool_run(int fd, char *filename, char *cgiargs, char *header);
+
+#endif // __CGI_POOL_H__
@@ -0,0 +1,31 @@
+#include <limits.h>
+#include <zlib.h>
+#include "io_helper.h"
+#include "gzip.h"
+
+char *gzip_encode(char *data, size_t len, size_t *outlen) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (len > UINT_MAX)
+	return NULL;
+    // 16 + 15: a gzip header and trailer around deflate with a 32K window
+    if (deflateInit2(&z, GZIP_LEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	return NULL;
+    
+    // room for the worst case, so one deflate() call does it all
+    uLong bound = deflateBound(&z, len);
+    char *out = malloc(bound);
+    assert(out != NULL);
+    z.next_in = (Bytef *) data;
+    z.avail_in = len;
+    z.next_out = (Bytef *) out;
+    z.avail_out = bound;
+    int rc = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (rc != Z_STREAM_END || z.total_out >= len) {
+	free(out);
+	return NULL;
+    }
+    *outlen = z.total_out;
+    return out;
+}
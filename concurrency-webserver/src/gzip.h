@@ -0,0 +1,17 @@
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <stddef.h>
+
+//
+// gzip (RFC 1952) encoding of responses, by way of zlib.  Compressed
+// copies are made once and kept in the cache (see request.c), so the level
+// favours size over speed.
+//
+#define GZIP_LEVEL (6)
+
+// Returns a malloc()'d gzip stream holding data, its length in *outlen,
+// or NULL if compressing would not make data any smaller
+char *gzip_encode(char *data, size_t len, size_t *outlen);
+
+#endif // __GZIP_H__
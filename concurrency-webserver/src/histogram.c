@@ -0,0 +1,59 @@
+#include <string.h>
+#include "histogram.h"
+
+void hist_init(histogram_t *h) {
+    memset(h, 0, sizeof(histogram_t));
+}
+
+static int hist_index(unsigned long v) {
+    if (v < HIST_SUB)
+	return v;
+    int msb = 63 - __builtin_clzl(v);
+    int shift = msb - HIST_SUB_BITS;
+    int i = (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// largest value that lands in bucket i
+static unsigned long hist_value(int i) {
+    if (i < HIST_SUB)
+	return i;
+    int shift = i / HIST_SUB - 1;
+    unsigned long sub = i % HIST_SUB;
+    return ((HIST_SUB + sub) << shift) + ((1UL << shift) - 1);
+}
+
+void hist_record(histogram_t *h, unsigned long value) {
+    h->counts[hist_index(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max)
+	h->max = value;
+}
+
+void hist_merge(histogram_t *into, histogram_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+	into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max)
+	into->max = from->max;
+}
+
+unsigned long hist_percentile(histogram_t *h, double p) {
+    if (h->total == 0)
+	return 0;
+    unsigned long want = (unsigned long) (p * h->total + 0.5), seen = 0;
+    if (want == 0)
+	want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+	seen += h->counts[i];
+	if (seen >= want)
+	    return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+double hist_mean(histogram_t *h) {
+    return h->total ? h->sum / h->total : 0.0;
+}
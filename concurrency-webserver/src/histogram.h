@@ -0,0 +1,34 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+//
+// Latency histogram in the style of HdrHistogram: values (microseconds,
+// say) are bucketed by power of two, and each power of two is split into
+// HIST_SUB linear sub-buckets, so any recorded value is reported to within
+// 1/HIST_SUB (under 1%) no matter how large it is.  Recording is an
+// increment of one counter, and histograms merge by adding counts.
+//
+// A histogram is not locked; each thread should record into its own and
+// merge them for reporting.
+//
+
+#define HIST_SUB_BITS (7)
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (32 * HIST_SUB)  // up to 2^38, about 76 hours in us
+
+typedef struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+    double sum;
+} histogram_t;
+
+void hist_init(histogram_t *h);
+void hist_record(histogram_t *h, unsigned long value);
+void hist_merge(histogram_t *into, histogram_t *from);
+
+// smallest value that at least fraction p (0..1) of the samples are <=
+unsigned long hist_percentile(histogram_t *h, double p);
+double hist_mean(histogram_t *h);
+
+#endif // __HISTOGRAM_H__
@@ -46,7 +46,7 @@ int open_client_fd(char *hostname, int port) {
     return client_fd;
 }
 
-int open_listen_fd(int port) {
+static int open_listen_fd_with(int port, int reuseport) {
     // Create a socket descriptor 
     int listen_fd;
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -61,6 +61,13 @@ int open_listen_fd(int port) {
 	return -1;
     }
     
+    // Lets several sockets bind the same port; the kernel then spreads
+    // incoming connections across them
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+	fprintf(stderr, "setsockopt() failed\n");
+	return -1;
+    }
+    
     // Listen_fd will be an endpoint for all requests to port on any IP address for this host
     struct sockaddr_in server_addr;
     bzero((char *) &server_addr, sizeof(server_addr));
@@ -80,4 +87,10 @@ int open_listen_fd(int port) {
     return listen_fd;
 }
 
+int open_listen_fd(int port) {
+    return open_listen_fd_with(port, 0);
+}
 
+int open_reuseport_listen_fd(int port) {
+    return open_listen_fd_with(port, 1);
+}
@@ -8,6 +8,8 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -15,10 +17,12 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -34,6 +38,8 @@ typedef struct sockaddr sockaddr_t;
     assert(execve(filename, argv, envp) == 0); 
 #define wait_or_die(status) \
     ({ pid_t pid = wait(status); assert(pid >= 0); pid; })
+#define waitpid_or_die(pid, status, options) \
+    ({ pid_t rc = waitpid(pid, status, options); assert(rc >= 0); rc; })
 #define gethostname_or_die(name, len) \
     ({ int rc = gethostname(name, len); assert(rc == 0); rc; })
 #define setenv_or_die(name, value, overwrite) \
@@ -46,6 +52,12 @@ typedef struct sockaddr sockaddr_t;
     ({ ssize_t rc = read(fd, buf, count); assert(rc >= 0); rc; })
 #define write_or_die(fd, buf, count) \
     ({ ssize_t rc = write(fd, buf, count); assert(rc >= 0); rc; })
+#define writev_or_die(fd, iov, iovcnt) \
+    ({ ssize_t rc = writev(fd, iov, iovcnt); assert(rc >= 0); rc; })
+#define send_or_die(s, buf, len, flags) \
+    ({ ssize_t rc = send(s, buf, len, flags); assert(rc >= 0); rc; })
+#define sendfile_or_die(out_fd, in_fd, offset, count) \
+    ({ ssize_t rc = sendfile(out_fd, in_fd, offset, count); assert(rc >= 0); rc; })
 #define lseek_or_die(fd, offset, whence) \
     ({ off_t rc = lseek(fd, offset, whence); assert(rc >= 0); rc; })
 #define close_or_die(fd) \
@@ -83,6 +95,7 @@ typedef struct sockaddr sockaddr_t;
 ssize_t readline(int fd, void *buf, size_t maxlen);
 int open_client_fd(char *hostname, int portno);
 int open_listen_fd(int portno);
+int open_reuseport_listen_fd(int portno);
 
 // wrappers for above
 #define readline_or_die(fd, buf, maxlen) \
@@ -91,5 +104,7 @@ int open_listen_fd(int portno);
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
 #define open_listen_fd_or_die(port) \
     ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define open_reuseport_listen_fd_or_die(port) \
+    ({ int rc = open_reuseport_listen_fd(port); assert(rc >= 0); rc; })
 
 #endif // __IO_HELPER__
@@ -0,0 +1,701 @@
+#define _GNU_SOURCE // pthread_setaffinity_np(), accept4()
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include "io_helper.h"
+#include "request.h"
+#include "cache.h"
+#include "stats.h"
+#include "uring.h"
+#include "listener.h"
+
+#define MAX_EVENTS (64)
+#define URING_ENTRIES (256)
+
+int listener_backend = LISTENER_EPOLL;
+
+typedef struct loop_conn {
+    conn_t conn;
+    double last_active;
+    struct loop_conn *prev, *next;  // idle list, least recently active first
+    int hangup;                     // close once the response is out
+
+    // file body being streamed, while streaming
+    int streaming, srcfd;
+    off_t offset, end;
+
+    // cached response being sent, while sending, and what it holds
+    int sending;
+    struct msghdr msg;
+    struct iovec iov[3];
+    char hdr[512];                  // copy of iov[0], which may be on a stack
+    cache_entry_t *entry;
+
+    int pollout;                    // epoll only: waiting for EPOLLOUT
+    int detached;                   // fd handed to a CGI thread; see
+				    // loop_dynamic_async()
+
+    // io_uring only
+    int inflight;                   // operations the kernel still has on this
+    int closed, eof;
+} loop_conn_t;
+
+typedef struct loop {
+    int id;
+    int port;
+    int listen_fd;
+    int epoll_fd;
+    uring_t ring;
+    int uring;                      // running the io_uring loop
+    int accept_once;                // multishot accept refused by the kernel
+    double accept_paused;           // when accepting was paused, or 0; see
+				    // accept_pause()
+    struct __kernel_timespec tick;
+    loop_conn_t *oldest, *newest;
+} loop_t;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void idle_unlink(loop_t *l, loop_conn_t *lc) {
+    if (lc->prev)
+	lc->prev->next = lc->next;
+    else
+	l->oldest = lc->next;
+    if (lc->next)
+	lc->next->prev = lc->prev;
+    else
+	l->newest = lc->prev;
+}
+
+static void idle_append(loop_t *l, loop_conn_t *lc) {
+    lc->last_active = now_seconds();
+    lc->next = NULL;
+    lc->prev = l->newest;
+    if (l->newest)
+	l->newest->next = lc;
+    else
+	l->oldest = lc;
+    l->newest = lc;
+}
+
+static void uring_arm_accept(loop_t *l);
+
+//
+// An accept that fails for want of descriptors or memory (EMFILE, ENFILE,
+// ENOBUFS, ENOMEM) would only fail again at once, while the connection
+// waiting for it keeps the listening socket readable; so the loop stops
+// accepting until a connection is closed or an idle tick has gone by,
+// whichever comes first.  The connections meanwhile wait in the listen
+// backlog.
+//
+static void accept_pause(loop_t *l) {
+    if (!l->uring)
+	assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, l->listen_fd, NULL) == 0);
+    l->accept_paused = now_seconds();
+}
+
+// accepts again if it has been paused for at least wait seconds
+static void accept_resume(loop_t *l, double wait) {
+    if (l->accept_paused == 0 || now_seconds() - l->accept_paused < wait)
+	return;
+    l->accept_paused = 0;
+    if (l->uring) {
+	uring_arm_accept(l);
+    } else {
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, l->listen_fd, &ev) == 0);
+    }
+}
+
+static void conn_close(loop_t *l, loop_conn_t *lc) {
+    idle_unlink(l, lc);
+    if (lc->detached) {
+	// nothing is in flight on it, and the CGI thread closes the descriptor
+	free(lc);
+	return;
+    }
+    if (lc->streaming) {
+	close_or_die(lc->srcfd);
+	lc->streaming = 0;
+    }
+    if (l->uring) {
+	// a send still on the ring drops its own entry when it completes
+	// a receive the kernel still holds ends, with 0, on shutdown(); the
+	// connection is freed when the last of its operations completes
+	shutdown(lc->conn.fd, SHUT_RDWR);
+	close_or_die(lc->conn.fd);
+	lc->closed = 1;
+	if (lc->inflight == 0)
+	    free(lc);
+	accept_resume(l, 0);
+	return;
+    }
+    // closing the descriptor also takes it out of the epoll set
+    if (lc->sending)
+	cache_release(lc->entry);
+    close_or_die(lc->conn.fd);
+    free(lc);
+    accept_resume(l, 0);
+}
+
+static void conn_accept(loop_t *l) {
+    // drain the accept queue; the listening socket is non-blocking
+    while (1) {
+	int fd = accept4(l->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return;
+	    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+		accept_pause(l);
+		return;
+	    }
+	    continue; // that connection failed (ECONNABORTED, EPROTO, ...)
+	}
+	loop_conn_t *lc = calloc(1, sizeof(loop_conn_t));
+	assert(lc != NULL);
+	lc->conn.fd = fd;
+	idle_append(l, lc);
+	
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = lc };
+	assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0);
+    }
+}
+
+static __thread loop_t *loop_self;
+static __thread loop_conn_t *loop_current;  // whose requests are being handled
+
+static void uring_arm_recv(loop_t *l, loop_conn_t *lc);
+static void uring_arm_pollout(loop_t *l, loop_conn_t *lc);
+
+static void set_nonblocking(int fd, int on) {
+    int flags = fcntl(fd, F_GETFL);
+    assert(flags >= 0);
+    assert(fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == 0);
+}
+
+//
+// Large file bodies (see request_send_large()).  While one is being sent
+// the socket is non-blocking, and the connection waits for the socket to
+// drain rather than the thread; a window of the file is sent each time it
+// has room.  Other responses are written in blocking mode, as they are
+// small.  Requests pipelined behind the stream wait for it to finish.
+//
+static int loop_stream_async(int fd, int srcfd, off_t offset, off_t end) {
+    loop_conn_t *lc = loop_current;
+    if (lc == NULL || lc->conn.fd != fd)
+	return 0;
+    lc->streaming = 1;
+    lc->srcfd = srcfd;
+    lc->offset = offset;
+    lc->end = end;
+    set_nonblocking(fd, 1);
+    return 1;
+}
+
+// the connection waits for room in the socket instead of new input
+static void conn_wait_writable(loop_t *l, loop_conn_t *lc) {
+    if (l->uring) {
+	uring_arm_pollout(l, lc);
+    } else if (!lc->pollout) {
+	struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = lc };
+	assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, lc->conn.fd, &ev) == 0);
+	lc->pollout = 1;
+    }
+    // a reader too slow to take anything for the idle timeout is cut off
+    idle_unlink(l, lc);
+    idle_append(l, lc);
+}
+
+static void conn_wait_readable(loop_t *l, loop_conn_t *lc) {
+    if (!l->uring && lc->pollout) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = lc };
+	assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, lc->conn.fd, &ev) == 0);
+	lc->pollout = 0;
+    }
+}
+
+//
+// Cached responses (see request_send_cached()) are taken over in the same
+// way, along with the reference on the cache entry: the epoll loop sends
+// what the socket will take without blocking and waits for EPOLLOUT for
+// the rest, and the io_uring loop queues a SENDMSG.  Either way the header
+// is copied, since a 206 header is built on the caller's stack.
+//
+static int loop_send_take(loop_conn_t *lc, int fd, struct iovec *iov, int iovcnt, cache_entry_t *e) {
+    if (lc == NULL || lc->conn.fd != fd || iovcnt > 3 || iov[0].iov_len > sizeof(lc->hdr))
+	return 0;
+    memcpy(lc->iov, iov, iovcnt * sizeof(struct iovec));
+    memcpy(lc->hdr, iov[0].iov_base, iov[0].iov_len);
+    lc->iov[0].iov_base = lc->hdr;
+    memset(&lc->msg, 0, sizeof(lc->msg));
+    lc->msg.msg_iov = lc->iov;
+    lc->msg.msg_iovlen = iovcnt;
+    lc->entry = e;
+    lc->sending = 1;
+    return 1;
+}
+
+static int loop_send_async(int fd, struct iovec *iov, int iovcnt, cache_entry_t *e) {
+    // conn_process() sends it, once request_handle() has returned
+    return loop_send_take(loop_current, fd, iov, iovcnt, e);
+}
+
+//
+// CGI programs may run for as long as they like, so a loop does not run
+// them itself, which would hold up every other connection it has.  It
+// hands the connection to a pool of threads shared by all the loops,
+// which run the program (see request_run_dynamic()) and then close the
+// connection, since a CGI response always ends it; the loop forgets the
+// connection there and then.  The pool grows whenever a request finds
+// every thread busy, so it ends up as big as the most CGI requests that
+// were ever running at once, and its threads are not pinned to a core.
+//
+typedef struct cgi_job {
+    int fd;
+    char *filename, *cgiargs;
+    struct cgi_job *next;
+} cgi_job_t;
+
+static cgi_job_t *cgi_head, *cgi_tail;
+static int cgi_queued, cgi_idle;
+static pthread_mutex_t cgi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgi_ready = PTHREAD_COND_INITIALIZER;
+
+static void *cgi_thread(void *arg) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < get_nprocs(); i++)
+	CPU_SET(i, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    
+    assert(pthread_mutex_lock(&cgi_lock) == 0);
+    while (1) {
+	cgi_idle++;
+	while (cgi_head == NULL)
+	    assert(pthread_cond_wait(&cgi_ready, &cgi_lock) == 0);
+	cgi_idle--;
+	cgi_job_t *j = cgi_head;
+	cgi_head = j->next;
+	cgi_queued--;
+	assert(pthread_mutex_unlock(&cgi_lock) == 0);
+	
+	request_run_dynamic(j->fd, j->filename, j->cgiargs);
+	close_or_die(j->fd);
+	free(j->filename);
+	free(j->cgiargs);
+	free(j);
+	assert(pthread_mutex_lock(&cgi_lock) == 0);
+    }
+    return NULL;
+}
+
+static int loop_dynamic_async(int fd, char *filename, char *cgiargs) {
+    loop_conn_t *lc = loop_current;
+    if (lc == NULL || lc->conn.fd != fd)
+	return 0;
+    // out of the epoll set before the CGI thread can close it: a CGI
+    // program holding a copy of the socket would otherwise keep it there
+    if (!loop_self->uring)
+	assert(epoll_ctl(loop_self->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == 0);
+    lc->detached = 1;
+    
+    cgi_job_t *j = malloc(sizeof(cgi_job_t));
+    assert(j != NULL);
+    j->fd = fd;
+    j->filename = strdup(filename);
+    j->cgiargs = strdup(cgiargs);
+    assert(j->filename != NULL && j->cgiargs != NULL);
+    j->next = NULL;
+    
+    assert(pthread_mutex_lock(&cgi_lock) == 0);
+    if (cgi_head == NULL)
+	cgi_head = j;
+    else
+	cgi_tail->next = j;
+    cgi_tail = j;
+    if (++cgi_queued > cgi_idle) {
+	pthread_t t;
+	assert(pthread_create(&t, NULL, cgi_thread, NULL) == 0);
+	assert(pthread_detach(t) == 0);
+    }
+    assert(pthread_cond_signal(&cgi_ready) == 0);
+    assert(pthread_mutex_unlock(&cgi_lock) == 0);
+    return 1;
+}
+
+// steps the message past n bytes sent; returns whether any are left
+static int msg_advance(struct msghdr *m, size_t n) {
+    while (m->msg_iovlen > 0 && n >= m->msg_iov->iov_len) {
+	n -= m->msg_iov->iov_len;
+	m->msg_iov++;
+	m->msg_iovlen--;
+    }
+    if (m->msg_iovlen > 0) {
+	m->msg_iov->iov_base = (char *) m->msg_iov->iov_base + n;
+	m->msg_iov->iov_len -= n;
+    }
+    return m->msg_iovlen > 0;
+}
+
+//
+// epoll only: sends what the socket will take of a cached response; returns
+// 1 when it is all out, 0 if the socket is full, or -1 if the connection
+// was closed
+//
+static int conn_send(loop_t *l, loop_conn_t *lc) {
+    struct msghdr *m = &lc->msg;
+    while (m->msg_iovlen > 0) {
+	ssize_t rc = sendmsg(lc->conn.fd, m, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    conn_wait_writable(l, lc);
+	    return 0;
+	}
+	if (rc < 0) {
+	    conn_close(l, lc);
+	    return -1;
+	}
+	msg_advance(m, rc);
+    }
+    cache_release(lc->entry);
+    lc->entry = NULL;
+    lc->sending = 0;
+    conn_wait_readable(l, lc);
+    return 1;
+}
+
+//
+// Sends what the socket will take; returns 1 when the body is all out, 0
+// if the socket is full, or -1 if the connection was closed
+//
+static int conn_stream(loop_t *l, loop_conn_t *lc) {
+    int fd = lc->conn.fd;
+    while (lc->offset < lc->end) {
+	ssize_t rc = request_stream_window(fd, lc->srcfd, &lc->offset, lc->end);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc < 0 && errno == EAGAIN) {
+	    conn_wait_writable(l, lc);
+	    return 0;
+	}
+	if (rc <= 0) {
+	    // the client went away, or the file shrank and the promised
+	    // Content-Length cannot be met
+	    conn_close(l, lc);
+	    return -1;
+	}
+    }
+    close_or_die(lc->srcfd);
+    lc->streaming = 0;
+    set_nonblocking(fd, 0);
+    conn_wait_readable(l, lc);
+    return 1;
+}
+
+//
+// Answers the complete requests in the buffer, stopping while a response
+// is still going out (a stream, or a cached response); then closes the
+// connection or waits for more input
+//
+static void conn_process(loop_t *l, loop_conn_t *lc) {
+    conn_t *c = &lc->conn;
+    do {
+	if (lc->streaming && conn_stream(l, lc) <= 0)
+	    return; // picked up again when the socket drains
+	if (lc->sending && !l->uring && conn_send(l, lc) <= 0)
+	    return; // likewise
+	loop_current = lc;
+	while (!lc->streaming && !lc->sending && !lc->hangup && request_ready(c)) {
+	    if (!request_handle(c))
+		lc->hangup = 1;
+	}
+	loop_current = NULL;
+    } while (lc->streaming || (lc->sending && !l->uring));
+    if (lc->sending)
+	return; // picked up again when the io_uring send completes
+    if (lc->hangup || lc->eof) {
+	conn_close(l, lc);
+	return;
+    }
+    if (l->uring) {
+	request_compact(c);
+	if (c->end == CONN_BUFSIZE) {
+	    request_error(c->fd, ERROR_HEAD_TOO_LARGE, 0);
+	    conn_close(l, lc);
+	    return;
+	}
+	uring_arm_recv(l, lc);
+    }
+    idle_unlink(l, lc);
+    idle_append(l, lc);
+}
+
+//
+// The connection is readable: take in what has arrived and answer every
+// complete request in it
+//
+static void conn_readable(loop_t *l, loop_conn_t *lc) {
+    conn_t *c = &lc->conn;
+    if (request_fill(c, 0) == 0) {
+	if (c->end - c->start == CONN_BUFSIZE)
+	    request_error(c->fd, ERROR_HEAD_TOO_LARGE, 0);
+	conn_close(l, lc);
+	return;
+    }
+    conn_process(l, lc);
+}
+
+static void close_idle(loop_t *l) {
+    double limit = now_seconds() - request_idle_timeout / 1000.0;
+    while (l->oldest != NULL && l->oldest->last_active < limit)
+	conn_close(l, l->oldest);
+}
+
+//
+// io_uring backend
+//
+// A multishot accept stays armed on the listening socket for good, or on
+// kernels that refuse the flag (before 5.19) a single-shot one is re-armed
+// after every connection; an accept that fails for want of descriptors or
+// memory is not re-armed for a while (see accept_pause()).  Each
+// connection has at most one receive outstanding, straight into its conn_t
+// buffer, armed only while the buffer has room and no response is being
+// sent; a client that pipelines faster than it is answered is held back by
+// TCP, not by buffering here.  Responses for cached files go out as
+// SENDMSGs on the ring (see request_send_async), a stream that fills the
+// socket waits on a POLL_ADD, and everything else goes through
+// request_handle() as in the epoll loop.  The SQEs queued while
+// working through one batch of completions all go to the kernel in the
+// io_uring_enter() that waits for the next batch.
+//
+#define OP_ACCEPT  (0)
+#define OP_RECV    (1)
+#define OP_SEND    (2)
+#define OP_TIMEOUT (3)
+#define OP_POLLOUT (4)
+#define OP_MASK    (7)      // user_data is the connection, tagged with these
+
+static void uring_arm_accept(loop_t *l) {
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->listen_fd;
+    sqe->ioprio = l->accept_once ? 0 : IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void uring_arm_timeout(loop_t *l) {
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) &l->tick;
+    sqe->len = 1;
+    sqe->user_data = OP_TIMEOUT;
+}
+
+static void uring_arm_recv(loop_t *l, loop_conn_t *lc) {
+    conn_t *c = &lc->conn;
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long) (c->buf + c->end);
+    sqe->len = CONN_BUFSIZE - c->end;
+    sqe->user_data = (unsigned long) lc | OP_RECV;
+    lc->inflight++;
+}
+
+static void uring_arm_pollout(loop_t *l, loop_conn_t *lc) {
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = lc->conn.fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (unsigned long) lc | OP_POLLOUT;
+    lc->inflight++;
+}
+
+static void uring_send(loop_t *l, loop_conn_t *lc) {
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = lc->conn.fd;
+    sqe->addr = (unsigned long) &lc->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long) lc | OP_SEND;
+    lc->inflight++;
+}
+
+static int uring_send_async(int fd, struct iovec *iov, int iovcnt, cache_entry_t *e) {
+    if (!loop_send_take(loop_current, fd, iov, iovcnt, e))
+	return 0;
+    uring_send(loop_self, loop_current);
+    return 1;
+}
+
+static void uring_complete(loop_t *l, unsigned long user_data, int res, unsigned flags) {
+    loop_conn_t *lc = (loop_conn_t *) (user_data & ~OP_MASK);
+    switch (user_data & OP_MASK) {
+    case OP_ACCEPT:
+	if (res >= 0) {
+	    lc = calloc(1, sizeof(loop_conn_t));
+	    assert(lc != NULL);
+	    lc->conn.fd = res;
+	    idle_append(l, lc);
+	    uring_arm_recv(l, lc);
+	}
+	if (flags & IORING_CQE_F_MORE)
+	    break;                  // still armed
+	if (res == -EINVAL && !l->accept_once) {
+	    l->accept_once = 1;
+	    uring_arm_accept(l);
+	} else if (res < 0 && res != -ECONNABORTED && res != -EPROTO && res != -EINTR) {
+	    accept_pause(l);
+	} else {
+	    uring_arm_accept(l);
+	}
+	break;
+    case OP_TIMEOUT:
+	close_idle(l);
+	accept_resume(l, 0);
+	uring_arm_timeout(l);
+	break;
+    case OP_RECV:
+	lc->inflight--;
+	if (lc->closed) {
+	    if (lc->inflight == 0)
+		free(lc);
+	    break;
+	}
+	if (res > 0) {
+	    lc->conn.end += res;
+	    lc->conn.arrived = stats_now();
+	} else {
+	    lc->eof = 1;
+	}
+	conn_process(l, lc);
+	break;
+    case OP_SEND:
+	lc->inflight--;
+	// after a short send, send the rest
+	if (res > 0 && !lc->closed && msg_advance(&lc->msg, res)) {
+	    uring_send(l, lc);
+	    break;
+	}
+	cache_release(lc->entry);
+	lc->entry = NULL;
+	lc->sending = 0;
+	if (lc->closed) {
+	    if (lc->inflight == 0)
+		free(lc);
+	} else if (res < 0) {
+	    conn_close(l, lc);
+	} else {
+	    conn_process(l, lc);
+	}
+	break;
+    case OP_POLLOUT:
+	lc->inflight--;
+	if (lc->closed) {
+	    if (lc->inflight == 0)
+		free(lc);
+	    break;
+	}
+	conn_process(l, lc);
+	break;
+    }
+}
+
+static void uring_run(loop_t *l) {
+    request_send_async = uring_send_async;
+    int tick = request_idle_timeout < 1000 ? request_idle_timeout : 1000;
+    l->tick.tv_sec = tick / 1000;
+    l->tick.tv_nsec = (tick % 1000) * 1000000L;
+    uring_arm_accept(l);
+    uring_arm_timeout(l);
+    while (1) {
+	uring_submit_and_wait(&l->ring);
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_cqe(&l->ring)) != NULL) {
+	    unsigned long user_data = cqe->user_data;
+	    int res = cqe->res;
+	    unsigned flags = cqe->flags;
+	    uring_cqe_seen(&l->ring);
+	    uring_complete(l, user_data, res, flags);
+	}
+    }
+}
+
+static void *loop_run(void *arg) {
+    loop_t *l = arg;
+    
+    // pin to one core; with more loops than cores they wrap around
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(l->id % get_nprocs(), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    
+    loop_self = l;
+    request_stream_async = loop_stream_async;
+    request_dynamic_async = loop_dynamic_async;
+    l->listen_fd = open_reuseport_listen_fd_or_die(l->port);
+    assert(fcntl(l->listen_fd, F_SETFL, O_NONBLOCK) == 0);
+    assert(fcntl(l->listen_fd, F_SETFD, FD_CLOEXEC) == 0);
+    
+    if (listener_backend == LISTENER_URING) {
+	int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+		      IORING_OP_TIMEOUT };
+	if (uring_init(&l->ring, URING_ENTRIES) == 0) {
+	    int ok = 1;
+	    for (int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		ok = ok && uring_supports(&l->ring, ops[i]);
+	    if (ok) {
+		l->uring = 1;
+		uring_run(l);
+	    }
+	    uring_exit(&l->ring);
+	    errno = ENOSYS;
+	}
+	if (l->id == 0)
+	    fprintf(stderr, "wserver: io_uring not available (%s), using epoll\n", strerror(errno));
+    }
+    request_send_async = loop_send_async;
+    l->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    assert(l->epoll_fd >= 0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    assert(epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, l->listen_fd, &ev) == 0);
+    
+    // wake up often enough to enforce the idle timeout
+    int tick = request_idle_timeout < 1000 ? request_idle_timeout : 1000;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+	int n = epoll_wait(l->epoll_fd, events, MAX_EVENTS, tick);
+	assert(n >= 0 || errno == EINTR);
+	for (int i = 0; i < n; i++) {
+	    if (events[i].data.ptr == NULL)
+		conn_accept(l);
+	    else if (((loop_conn_t *) events[i].data.ptr)->pollout)
+		conn_process(l, events[i].data.ptr);
+	    else
+		conn_readable(l, events[i].data.ptr);
+	}
+	close_idle(l);
+	accept_resume(l, tick / 1000.0);
+    }
+    return NULL;
+}
+
+void listener_start(int port, int nthreads) {
+    for (int i = 0; i < nthreads; i++) {
+	loop_t *l = calloc(1, sizeof(loop_t));
+	assert(l != NULL);
+	l->id = i;
+	l->port = port;
+	pthread_t t;
+	assert(pthread_create(&t, NULL, loop_run, l) == 0);
+	assert(pthread_detach(t) == 0);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+//
+// Multi-listener mode: nthreads threads, each pinned to a core, each with
+// its own SO_REUSEPORT listening socket on port and its own event loop over
+// that socket and the connections it accepted.  The kernel spreads new
+// connections across the listening sockets, so accepts never contend on a
+// shared socket and a connection stays on the core that accepted it.
+//
+// With listener_backend set to LISTENER_URING, each thread runs an
+// io_uring loop instead of the epoll one (see listener.c), falling back to
+// epoll if the kernel does not allow io_uring.
+//
+// CGI programs do not run on the loops: a dynamic request's connection is
+// handed to a pool of threads shared by all of them, which grows to as
+// many as are running programs at once, so a slow program holds up only
+// its own client.
+//
+// Returns once all threads are running; they never exit.
+//
+#define LISTENER_EPOLL (0)
+#define LISTENER_URING (1)
+
+extern int listener_backend;
+
+void listener_start(int port, int nthreads);
+
+#endif // __LISTENER_H__
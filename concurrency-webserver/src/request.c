@@ -1,5 +1,10 @@
+#include <pthread.h>
 #include "io_helper.h"
 #include "request.h"
+#include "cache.h"
+#include "cgi_pool.h"
+#include "gzip.h"
+#include "stats.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
@@ -8,173 +13,915 @@
 
 #define MAXBUF (8192)
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
-    
-    // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
-	    "<!doctype html>\r\n"
-	    "<head>\r\n"
-	    "  <title>OSTEP WebServer Error</title>\r\n"
-	    "</head>\r\n"
-	    "<body>\r\n"
-	    "  <h2>%s: %s</h2>\r\n" 
-	    "  <p>%s: %s</p>\r\n"
-	    "</body>\r\n"
-	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
-    
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
+// files up to this size are read() into memory and go out with the header
+// in a single writev(); bigger ones are streamed (see request_stream_window())
+#define SMALL_FILE (16384)
+
+// most that one sendfile() (or one mmap() and write()) of a streamed body
+// moves, so a huge file is never mapped whole
+#define STREAM_WINDOW (1 << 20)
+
+int request_static_mode = STATIC_SENDFILE;
+int request_idle_timeout = 5000;
+int request_keep_alive = 1;
+__thread int (*request_send_async)(int fd, struct iovec *iov, int iovcnt, cache_entry_t *e) = NULL;
+__thread int (*request_stream_async)(int fd, int srcfd, off_t offset, off_t end) = NULL;
+__thread int (*request_dynamic_async)(int fd, char *filename, char *cgiargs) = NULL;
+
+//
+// Last header line of every response; says whether the connection stays open
+//
+char *request_conn_header(int keep_alive) {
+    return keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+//
+// writev() the whole vector, picking up after any short writes.  Returns -1
+// if the connection failed, however it failed (a reset, a timeout, an
+// unreachable peer): that is the client's problem, not the server's, and
+// the next read from it finds that out.
+//
+int request_writev(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+	ssize_t rc = writev(fd, iov, iovcnt);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc < 0)
+	    return -1;
+	// skip over whatever a short write already sent
+	while (iovcnt > 0 && rc >= iov->iov_len) {
+	    rc -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + rc;
+	    iov->iov_len -= rc;
+	}
+    }
+    return 0;
+}
+
+//
+// Error responses never change, so each is rendered once, on first use;
+// sending one is then a single writev() with no formatting
+//
+typedef struct error_response {
+    char *errnum, *shortmsg, *longmsg;
+    int status, headlen, bodylen;
+    char head[256];
+    char body[512];
+} error_response_t;
+
+static error_response_t errors[] = {
+    [ERROR_BAD_REQUEST]     = { "400", "Bad Request", "server could not parse this request" },
+    [ERROR_FORBIDDEN]       = { "403", "Forbidden", "server could not read this file" },
+    [ERROR_FORBIDDEN_CGI]   = { "403", "Forbidden", "server could not run this CGI program" },
+    [ERROR_NOT_FOUND]       = { "404", "Not found", "server could not find this file" },
+    [ERROR_HEAD_TOO_LARGE]  = { "431", "Request Header Fields Too Large", "server could not buffer this request" },
+    [ERROR_RANGE]           = { "416", "Range Not Satisfiable", "server could not find this range in the file" },
+    [ERROR_CGI_FAILED]      = { "500", "Internal Server Error", "CGI program did not respond" },
+    [ERROR_NOT_IMPLEMENTED] = { "501", "Not Implemented", "server does not implement this method" },
+};
+
+static pthread_once_t errors_once = PTHREAD_ONCE_INIT;
+
+static void request_render_errors() {
+    for (int i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+	error_response_t *e = &errors[i];
+	e->status = atoi(e->errnum);
+	e->bodylen = sprintf(e->body, ""
+			     "<!doctype html>\r\n"
+			     "<head>\r\n"
+			     "  <title>OSTEP WebServer Error</title>\r\n"
+			     "</head>\r\n"
+			     "<body>\r\n"
+			     "  <h2>%s: %s</h2>\r\n" 
+			     "  <p>%s</p>\r\n"
+			     "</body>\r\n"
+			     "</html>\r\n", e->errnum, e->shortmsg, e->longmsg);
+	e->headlen = sprintf(e->head, ""
+			     "HTTP/1.1 %s %s\r\n"
+			     "Content-Type: text/html\r\n"
+			     "Content-Length: %d\r\n", e->errnum, e->shortmsg, e->bodylen);
+    }
+}
+
+//
+// Sends a canned error; extra, if not NULL, is one more header line
+//
+void request_error_with(int fd, int error, int keep_alive, char *extra) {
+    assert(pthread_once(&errors_once, request_render_errors) == 0);
+    error_response_t *e = &errors[error];
+    char *conn = request_conn_header(keep_alive);
+    struct iovec iov[4];
+    iov[0].iov_base = e->head;
+    iov[0].iov_len = e->headlen;
+    iov[1].iov_base = extra ? extra : "";
+    iov[1].iov_len = extra ? strlen(extra) : 0;
+    iov[2].iov_base = conn;
+    iov[2].iov_len = strlen(conn);
+    iov[3].iov_base = e->body;
+    iov[3].iov_len = e->bodylen;
+    request_writev(fd, iov, 4);
+    stats_response(e->status, e->headlen + iov[1].iov_len + iov[2].iov_len + e->bodylen);
+}
+
+void request_error(int fd, int error, int keep_alive) {
+    request_error_with(fd, error, keep_alive, NULL);
+}
+
+// 416, saying how big the file really is
+void request_range_error(int fd, off_t filesize, int keep_alive) {
+    char extra[64];
+    sprintf(extra, "Content-Range: bytes */%lld\r\n", (long long) filesize);
+    request_error_with(fd, ERROR_RANGE, keep_alive, extra);
+}
+
+//
+// Returns the length of the request head (request line, headers and the
+// empty line ending them) at the front of the connection buffer, or 0 if
+// it has not all arrived yet.  Lines may end in either CRLF or a bare LF.
+//
+int request_ready(conn_t *c) {
+    // stray empty lines ahead of a request line are ignored (RFC 7230 3.5)
+    while (c->start < c->end && (c->buf[c->start] == '\r' || c->buf[c->start] == '\n'))
+	c->start++;
     
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
+    char *head = c->buf + c->start, *end = c->buf + c->end, *line = head, *nl;
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+	if (line != head && (nl == line || (nl == line + 1 && line[0] == '\r')))
+	    return nl + 1 - head;
+	line = nl + 1;
+    }
+    return 0;
+}
+
+//
+// Moves the unparsed input to the front of the buffer, making room after it
+//
+void request_compact(conn_t *c) {
+    if (c->start > 0) {
+	memmove(c->buf, c->buf + c->start, c->end - c->start);
+	c->end -= c->start;
+	c->start = 0;
+    }
+}
+
+//
+// Reads more input into the connection buffer, first waiting up to
+// timeout_ms for it to arrive.  Returns 0 on EOF, timeout, or a full buffer.
+//
+int request_fill(conn_t *c, int timeout_ms) {
+    request_compact(c);
+    if (c->end == CONN_BUFSIZE)
+	return 0;
     
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+	return 0;
+    int rc = read(c->fd, c->buf + c->end, CONN_BUFSIZE - c->end);
+    if (rc <= 0)
+	return 0;
+    c->end += rc;
+    c->arrived = stats_now();
+    return rc;
+}
+
+static int str_eq(str_t s, char *lit, int len) {
+    return s.len == len && strncasecmp(s.p, lit, len) == 0;
+}
+
+//
+// Does an Accept-Encoding: value allow gzip?  It does if it lists gzip (or
+// x-gzip), or failing that "*", with any q but 0.  The weights are not
+// otherwise compared; gzip is the only coding we have.
+//
+static int request_accepts_gzip(char *p, char *end) {
+    int gzip = -1, any = -1;
+    while (p < end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+	    p++;
+	char *coding = p;
+	while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t' && *p != '\r')
+	    p++;
+	int len = p - coding, ok = 1;
+	// parameters, up to the next coding; only q=0 (or 0.0, ...) matters
+	while (p < end && *p != ',') {
+	    if ((*p | 0x20) == 'q' && p + 1 < end && p[1] == '=') {
+		for (p += 2; p < end && (*p == '0' || *p == '.'); p++)
+		    ;
+		ok = p < end && *p >= '1' && *p <= '9';
+		continue;
+	    }
+	    p++;
+	}
+	if ((len == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+	    (len == 6 && strncasecmp(coding, "x-gzip", 6) == 0))
+	    gzip = ok;
+	else if (len == 1 && coding[0] == '*')
+	    any = ok;
+    }
+    return gzip >= 0 ? gzip : any > 0;
+}
+
+//
+// The file name is the path without its leading '/', opened relative to the
+// document root; so the path must not start with "//", which would make
+// the name absolute, nor climb out of the root through a ".." segment.
+//
+static int request_path_ok(str_t path) {
+    if (path.len == 0 || path.p[0] != '/' || (path.len > 1 && path.p[1] == '/'))
+	return 0;
+    for (char *seg = path.p + 1, *end = path.p + path.len; seg <= end; seg++) {
+	char *slash = memchr(seg, '/', end - seg);
+	char *segend = slash ? slash : end;
+	if (segend - seg == 2 && seg[0] == '.' && seg[1] == '.')
+	    return 0;
+	seg = segend;
+    }
+    return 1;
+}
+
+//
+// Splits the request head into views of the connection buffer; nothing is
+// copied.  Also works out whether the client wants the connection kept
+// open: HTTP/1.1 defaults to yes and HTTP/1.0 to no, unless a Connection:
+// header says otherwise.  Returns -1 if the request line is malformed or
+// its path reaches outside the document root.
+//
+int request_parse(char *head, int headlen, request_t *r) {
+    char *p = head, *end = head + headlen;
+    str_t *fields[] = { &r->method, &r->uri, &r->version };
     
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
+    // request line: method, uri and version separated by blanks
+    for (int i = 0; i < 3; i++) {
+	while (p < end && (*p == ' ' || *p == '\t'))
+	    p++;
+	fields[i]->p = p;
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+	    p++;
+	fields[i]->len = p - fields[i]->p;
+	if (fields[i]->len == 0)
+	    return -1;
+    }
+    char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL)
+	return -1;
+    
+    // uri: path, then an optional ?query
+    char *q = memchr(r->uri.p, '?', r->uri.len);
+    r->path.p = r->uri.p;
+    r->path.len = q ? q - r->uri.p : r->uri.len;
+    r->query.p = q ? q + 1 : r->uri.p + r->uri.len;
+    r->query.len = r->uri.p + r->uri.len - r->query.p;
+    if (!request_path_ok(r->path))
+	return -1;
+    
+    r->keep_alive = str_eq(r->version, "HTTP/1.1", 8);
+    r->range.p = NULL;
+    r->range.len = 0;
+    r->gzip = 0;
+    int if_range = 0;
+    for (char *line = nl + 1; (nl = memchr(line, '\n', end - line)) != NULL; line = nl + 1) {
+	// only four headers matter; the first letter rules out the rest
+	char *value;
+	switch (line[0] | 0x20) {
+	case 'a':
+	    if (nl - line >= 16 && strncasecmp(line, "Accept-Encoding:", 16) == 0)
+		r->gzip = request_accepts_gzip(line + 16, nl);
+	    break;
+	case 'c':
+	    if (nl - line < 11 || strncasecmp(line, "Connection:", 11) != 0)
+		continue;
+	    value = line + 11;
+	    while (*value == ' ' || *value == '\t')
+		value++;
+	    if (strncasecmp(value, "close", 5) == 0)
+		r->keep_alive = 0;
+	    else if (strncasecmp(value, "keep-alive", 10) == 0)
+		r->keep_alive = 1;
+	    break;
+	case 'r':
+	    if (nl - line < 6 || strncasecmp(line, "Range:", 6) != 0)
+		continue;
+	    value = line + 6;
+	    while (*value == ' ' || *value == '\t')
+		value++;
+	    r->range.p = value;
+	    r->range.len = nl - value;
+	    while (r->range.len > 0 && (value[r->range.len - 1] == '\r' || value[r->range.len - 1] == ' '))
+		r->range.len--;
+	    break;
+	case 'i':
+	    if (nl - line >= 9 && strncasecmp(line, "If-Range:", 9) == 0)
+		if_range = 1;
+	    break;
+	}
+    }
+    // we send no validators, so no If-Range: can match one; the whole file
+    // is sent instead, as RFC 7233 3.2 asks
+    if (if_range)
+	r->range.len = 0;
+    return 0;
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Works out which bytes of a file of the given size a Range: header asks
+// for.  Only a single range of bytes is supported; anything else is
+// ignored, and the whole file sent, which RFC 7233 allows.
 //
-void request_read_headers(int fd) {
-    char buf[MAXBUF];
+int request_resolve_range(str_t spec, off_t size, range_t *r) {
+    char *p = spec.p, *end = spec.p + spec.len;
+    if (spec.len < 6 || strncasecmp(p, "bytes=", 6) != 0 || memchr(p, ',', spec.len) != NULL)
+	return RANGE_NONE;
+    p += 6;
     
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
+    // first-last, first-, or -suffix
+    off_t pos[2] = { -1, -1 };
+    for (int i = 0; i < 2; i++) {
+	if (p < end && *p >= '0' && *p <= '9') {
+	    pos[i] = 0;
+	    for (int digits = 0; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		if (digits == 18)
+		    return RANGE_NONE; // too big for an off_t
+		pos[i] = pos[i] * 10 + (*p - '0');
+	    }
+	}
+	if (i == 0 && (p == end || *p++ != '-'))
+	    return RANGE_NONE;
+    }
+    if (p != end || (pos[0] < 0 && pos[1] < 0) || (pos[1] >= 0 && pos[1] < pos[0]))
+	return RANGE_NONE;
+    
+    if (pos[0] < 0) {
+	// the last pos[1] bytes
+	if (pos[1] == 0 || size == 0)
+	    return RANGE_UNSATISFIABLE;
+	r->first = pos[1] < size ? size - pos[1] : 0;
+    } else {
+	if (pos[0] >= size)
+	    return RANGE_UNSATISFIABLE;
+	r->first = pos[0];
     }
-    return;
+    r->last = pos[0] >= 0 && pos[1] >= 0 && pos[1] < size ? pos[1] : size - 1;
+    return RANGE_OK;
+}
+
+//
+// Static unless "cgi" appears anywhere in the uri
+//
+int request_is_static(str_t uri) {
+    for (int i = 0; i + 3 <= uri.len; i++)
+	if (uri.p[i] == 'c' && uri.p[i + 1] == 'g' && uri.p[i + 2] == 'i')
+	    return 0;
+    return 1;
 }
 
 //
-// Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
+// Returns the content type for the filename's extension
 //
-int request_parse_uri(char *uri, char *filename, char *cgiargs) {
-    char *ptr;
+char *request_get_filetype(char *filename) {
+    char *ext = strrchr(filename, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL)
+	return "text/plain";
+    ext++;
     
-    if (!strstr(uri, "cgi")) { 
-	// static
-	strcpy(cgiargs, "");
-	sprintf(filename, ".%s", uri);
-	if (uri[strlen(uri)-1] == '/') {
-	    strcat(filename, "index.html");
+    // switch on length, then first letter, so that at most one comparison is made
+    switch (strlen(ext)) {
+    case 2:
+	if (ext[0] == 'j' && ext[1] == 's')
+	    return "text/javascript";
+	break;
+    case 3:
+	switch (ext[0]) {
+	case 'c': if (!memcmp(ext, "css", 3)) return "text/css"; break;
+	case 'g': if (!memcmp(ext, "gif", 3)) return "image/gif"; break;
+	case 'h': if (!memcmp(ext, "htm", 3)) return "text/html"; break;
+	case 'j': if (!memcmp(ext, "jpg", 3)) return "image/jpeg"; break;
+	case 'p': if (!memcmp(ext, "png", 3)) return "image/png"; break;
 	}
-	return 1;
-    } else { 
-	// dynamic
-	ptr = index(uri, '?');
-	if (ptr) {
-	    strcpy(cgiargs, ptr+1);
-	    *ptr = '\0';
-	} else {
-	    strcpy(cgiargs, "");
+	break;
+    case 4:
+	switch (ext[0]) {
+	case 'h': if (!memcmp(ext, "html", 4)) return "text/html"; break;
+	case 'j': if (!memcmp(ext, "jpeg", 4)) return "image/jpeg"; break;
 	}
-	sprintf(filename, ".%s", uri);
-	return 0;
+	break;
     }
+    return "text/plain";
 }
 
 //
-// Fills in the filetype given the filename
+// Worth gzip'ing?  Only text is; the image formats are compressed already
 //
-void request_get_filetype(char *filename, char *filetype) {
-    if (strstr(filename, ".html")) 
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif")) 
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg")) 
-	strcpy(filetype, "image/jpeg");
-    else 
-	strcpy(filetype, "text/plain");
+int request_compressible(char *filetype) {
+    return strncmp(filetype, "text/", 5) == 0;
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
-    char buf[MAXBUF], *argv[] = { NULL };
+static char *append(char *p, char *s, int len) {
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static char *append_number(char *p, off_t n) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+	digits[--i] = '0' + n % 10;
+	n /= 10;
+    } while (n > 0);
+    return append(p, digits + i, sizeof(digits) - i);
+}
+
+//
+// Builds the 200 header for a static file (minus the Connection: line)
+// without going through printf, or the 206 header if only range of it is
+// being sent; returns its length.  If encoding is not NULL, the body is
+// the file in that Content-Encoding, and filesize is its encoded size.
+//
+int request_static_header(char *buf, off_t filesize, char *filetype, range_t *range, char *encoding) {
+    char *p = buf;
+#define APPEND(lit) p = append(p, lit, sizeof(lit) - 1)
+    if (range == NULL)
+	APPEND("HTTP/1.1 200 OK\r\n"
+	       "Server: OSTEP WebServer\r\n");
+    else
+	APPEND("HTTP/1.1 206 Partial Content\r\n"
+	       "Server: OSTEP WebServer\r\n");
+    // ranges are served of the file as it is, never of an encoding of it
+    if (encoding == NULL)
+	APPEND("Accept-Ranges: bytes\r\n");
+    if (range != NULL) {
+	APPEND("Content-Range: bytes ");
+	p = append_number(p, range->first);
+	APPEND("-");
+	p = append_number(p, range->last);
+	APPEND("/");
+	p = append_number(p, filesize);
+	APPEND("\r\n");
+    }
+    APPEND("Content-Length: ");
+    p = append_number(p, range ? range->last - range->first + 1 : filesize);
+    APPEND("\r\nContent-Type: ");
+    p = append(p, filetype, strlen(filetype));
+    APPEND("\r\n");
+    if (encoding != NULL) {
+	APPEND("Content-Encoding: ");
+	p = append(p, encoding, strlen(encoding));
+	APPEND("\r\n");
+    }
+    // the same URI may come back either way, so shared caches must tell
+    // the two apart
+    if (request_compressible(filetype))
+	APPEND("Vary: Accept-Encoding\r\n");
+#undef APPEND
+    return p - buf;
+}
+
+//
+// Runs the program for a dynamic request, which writes the response
+// straight to fd; returns the status sent.  It records no statistics but
+// the status of an error response, so it may run on a thread that is not
+// handling requests (see request_dynamic_async).
+//
+int request_run_dynamic(int fd, char *filename, char *cgiargs) {
+    char *argv[] = { NULL };
     
     // The server does only a little bit of the header.  
     // The CGI script has to finish writing out the header.
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n");
+    char buf[] = ""
+	"HTTP/1.1 200 OK\r\n"
+	"Server: OSTEP WebServer\r\n"
+	"Connection: close\r\n";
+    
+    switch (cgi_pool_run(fd, filename, cgiargs, buf)) {
+    case CGI_POOL_DONE:
+	return 200;
+    case CGI_POOL_FAILED:
+	request_error(fd, ERROR_CGI_FAILED, 0);
+	return 500;
+    }
     
     write_or_die(fd, buf, strlen(buf));
     
-    if (fork_or_die() == 0) {                        // child
+    pid_t pid = fork_or_die();
+    if (pid == 0) {                                  // child
 	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
 	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
 	extern char **environ;                       // defined by libc 
 	execve_or_die(filename, argv, environ);
+    }
+    // just this one: other threads' CGI programs, and the pool's workers,
+    // are children of this process too
+    waitpid_or_die(pid, NULL, 0);
+    return 200;
+}
+
+void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
+    // the program writes (most of) the response itself, so all of its
+    // running time is charged to I/O, and its output is not counted; a
+    // request handed to another thread is logged as it is handed over, as
+    // if it succeeded
+    if (request_dynamic_async != NULL && request_dynamic_async(fd, filename, cgiargs)) {
+	stats_response(200, 0);
+	return;
+    }
+    int status = request_run_dynamic(fd, filename, cgiargs);
+    stats_mark(STATS_IO);
+    if (status == 200)
+	stats_response(200, 0);
+}
+
+//
+// Small files: one pread() into a stack buffer, one writev() of header + body
+//
+void request_send_small(int fd, int srcfd, char *hdr, int hdrlen, off_t offset, int len) {
+    char body[SMALL_FILE];
+    int n = 0;
+    while (n < len) {
+	int rc = pread(srcfd, body + n, len - n, offset + n);
+	assert(rc >= 0);
+	if (rc == 0)
+	    break; // file shrank under us; send what we have
+	n += rc;
+    }
+    stats_mark(STATS_IO);
+    
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hdrlen;
+    iov[1].iov_base = body;
+    iov[1].iov_len = n;
+    request_writev(fd, iov, 2);
+}
+
+//
+// Cached files: header and body already sit together in memory; only the
+// Connection: line is spliced in between them.  For a range, a 206 header
+// is put in front of that part of the body instead.  Drops the reference
+// on e, or hands it to request_send_async along with the iovecs.
+//
+void request_send_cached(int fd, cache_entry_t *e, int keep_alive, range_t *range, char *filename) {
+    char *conn = request_conn_header(keep_alive);
+    char hdr[MAXBUF];
+    struct iovec iov[3];
+    off_t filesize = e->size - e->hdrlen;
+    if (range == NULL) {
+	iov[0].iov_base = e->data;
+	iov[0].iov_len = e->hdrlen;
+	iov[2].iov_base = e->data + e->hdrlen;
+	iov[2].iov_len = filesize;
     } else {
-	wait_or_die(NULL);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = request_static_header(hdr, filesize, request_get_filetype(filename), range, NULL);
+	iov[2].iov_base = e->data + e->hdrlen + range->first;
+	iov[2].iov_len = range->last - range->first + 1;
     }
+    iov[1].iov_base = conn;
+    iov[1].iov_len = strlen(conn);
+    stats_response(range ? 206 : 200, iov[0].iov_len + iov[1].iov_len + iov[2].iov_len);
+    if (request_send_async != NULL && request_send_async(fd, iov, 3, e))
+	return;
+    request_writev(fd, iov, 3);
+    cache_release(e);
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
+//
+// Sends the next window of srcfd[*offset, end) and moves *offset past what
+// was sent.  Returns what write() or sendfile() did: the bytes sent, 0 if
+// the file ended early, or -1 with errno set (EAGAIN if the socket is
+// non-blocking and full).
+//
+ssize_t request_stream_window(int fd, int srcfd, off_t *offset, off_t end) {
+    size_t len = end - *offset < STREAM_WINDOW ? end - *offset : STREAM_WINDOW;
+    if (request_static_mode == STATIC_SENDFILE)
+	return sendfile(fd, srcfd, offset, len);
     
-    request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
+    // map just this window; mappings must start on a page boundary
+    off_t base = *offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+    char *srcp = mmap_or_die(0, len + (*offset - base), PROT_READ, MAP_PRIVATE, srcfd, base);
+    ssize_t rc = write(fd, srcp + (*offset - base), len);
+    munmap_or_die(srcp, len + (*offset - base));
+    if (rc > 0)
+	*offset += rc;
+    return rc;
+}
+
+//
+// Large files: the header is sent with MSG_MORE so that it is corked
+// together with the first window of the body.  An event loop takes the
+// rest from there, sending as the client drains the socket (see
+// listener.c); otherwise it is sent here, one window at a time.  Either
+// way only a window of the file is in flight at once.  Returns 0 if the
+// connection cannot be used again.
+//
+int request_send_large(int fd, int srcfd, char *hdr, int hdrlen, off_t offset, off_t end) {
+    stats_mark(STATS_IO);
+    for (int n = 0; n < hdrlen; ) {
+	int rc = send(fd, hdr + n, hdrlen - n, MSG_MORE | MSG_NOSIGNAL);
+	if (rc < 0) {
+	    close_or_die(srcfd);
+	    return 0;
+	}
+	n += rc;
+    }
+    if (request_stream_async != NULL && request_stream_async(fd, srcfd, offset, end))
+	return 1;
     
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    while (offset < end) {
+	if (request_stream_window(fd, srcfd, &offset, end) <= 0)
+	    break; // client gone, or the file shrank under us
+    }
     close_or_die(srcfd);
+    return offset == end;
+}
+
+//
+// Sends srcfd[offset, end) under hdr, which is completed with the
+// Connection: line, and closes srcfd.  Returns 0 if the connection cannot
+// be used again.
+//
+int request_send_file(int fd, int srcfd, char *hdr, int hdrlen, int keep_alive, int status,
+		      off_t offset, off_t end) {
+    char *conn = request_conn_header(keep_alive);
+    memcpy(hdr + hdrlen, conn, strlen(conn));
+    hdrlen += strlen(conn);
+    stats_response(status, hdrlen + end - offset);
+    
+    if (request_static_mode == STATIC_SENDFILE && end - offset <= SMALL_FILE) {
+	request_send_small(fd, srcfd, hdr, hdrlen, offset, end - offset);
+	close_or_die(srcfd);
+	return keep_alive;
+    }
+    // in mmap mode, the mapping is made (a window at a time) by
+    // request_stream_window(), rather than read() into a buffer
+    if (!request_send_large(fd, srcfd, hdr, hdrlen, offset, end))
+	return 0;
+    return keep_alive;
+}
+
+//
+// Sends a text file gzip'ed: as the .gz file next to it, if there is one
+// no older than it, or else compressed here.  That is done once; the
+// result goes into the cache, which then serves it until the file
+// changes.  Returns -1, having sent nothing, if the file should go out as
+// it is instead; otherwise what request_serve_static() does.
+//
+int request_serve_gzip(int fd, char *filename, struct stat *sbuf, int keep_alive) {
+    char gzname[MAXBUF], hdr[MAXBUF];
+    char *filetype = request_get_filetype(filename);
+    struct stat gzbuf;
+    cache_entry_t *e;
+    int srcfd, hdrlen;
     
-    // put together response
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n"
-	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
+    if (snprintf(gzname, sizeof(gzname), "%s.gz", filename) < sizeof(gzname) &&
+	stat(gzname, &gzbuf) == 0 && S_ISREG(gzbuf.st_mode) && (S_IRUSR & gzbuf.st_mode) &&
+	(gzbuf.st_mtim.tv_sec > sbuf->st_mtim.tv_sec ||
+	 (gzbuf.st_mtim.tv_sec == sbuf->st_mtim.tv_sec &&
+	  gzbuf.st_mtim.tv_nsec >= sbuf->st_mtim.tv_nsec))) {
+	srcfd = open_or_die(gzname, O_RDONLY, 0);
+	hdrlen = request_static_header(hdr, gzbuf.st_size, filetype, NULL, "gzip");
+	if (cache_admit(gzbuf.st_size)) {
+	    e = cache_insert(filename, CACHE_GZIP, gzname, &gzbuf, hdr, hdrlen, srcfd);
+	    if (e != NULL) {
+		close_or_die(srcfd);
+		stats_mark(STATS_IO);
+		request_send_cached(fd, e, keep_alive, NULL, filename);
+		return keep_alive;
+	    }
+	}
+	return request_send_file(fd, srcfd, hdr, hdrlen, keep_alive, 200, 0, gzbuf.st_size);
+    }
     
-    write_or_die(fd, buf, strlen(buf));
+    // without the cache it would be compressed again on every request
+    if (!cache_admit(sbuf->st_size))
+	return -1;
+    size_t len = sbuf->st_size, n = 0, zlen;
+    char *data = malloc(len > 0 ? len : 1);
+    assert(data != NULL);
+    srcfd = open_or_die(filename, O_RDONLY, 0);
+    while (n < len) {
+	ssize_t rc = read_or_die(srcfd, data + n, len - n);
+	if (rc == 0)
+	    break;
+	n += rc;
+    }
+    close_or_die(srcfd);
+    if (n != len) {
+	// changed while we were reading it
+	free(data);
+	return -1;
+    }
     
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    // if gzip does not make it any smaller, the file as it is gets cached
+    // for gzip requests instead, so that is found out only once too
+    char *z = gzip_encode(data, len, &zlen);
+    if (z != NULL) {
+	hdrlen = request_static_header(hdr, zlen, filetype, NULL, "gzip");
+	e = cache_insert_data(filename, CACHE_GZIP, filename, sbuf, hdr, hdrlen, z, zlen);
+	free(z);
+    } else {
+	hdrlen = request_static_header(hdr, len, filetype, NULL, NULL);
+	e = cache_insert_data(filename, CACHE_GZIP, filename, sbuf, hdr, hdrlen, data, len);
+    }
+    free(data);
+    stats_mark(STATS_IO);
+    request_send_cached(fd, e, keep_alive, NULL, filename);
+    return keep_alive;
+}
+
+//
+// Serves a file, or the part of it the request's Range: asks for, gzip'ed
+// if the client takes that and it is worth doing.  Returns 0 if the
+// connection cannot be used again.
+//
+int request_serve_static(int fd, char *filename, struct stat *sbuf, int keep_alive, str_t range_spec,
+			 int gzip) {
+    int srcfd, hdrlen;
+    off_t filesize = sbuf->st_size;
+    char buf[MAXBUF];
+    range_t range, *rp = NULL;
+    
+    if (gzip && (keep_alive = request_serve_gzip(fd, filename, sbuf, keep_alive)) >= 0)
+	return keep_alive;
+    
+    switch (request_resolve_range(range_spec, filesize, &range)) {
+    case RANGE_OK:
+	rp = &range;
+	break;
+    case RANGE_UNSATISFIABLE:
+	stats_mark(STATS_IO);
+	request_range_error(fd, filesize, keep_alive);
+	return keep_alive;
+    }
+    
+    srcfd = open_or_die(filename, O_RDONLY, 0);
+    
+    if (cache_admit(filesize)) {
+	// the cache keeps the whole file's header, without the Connection: line
+	hdrlen = request_static_header(buf, filesize, request_get_filetype(filename), NULL, NULL);
+	cache_entry_t *e = cache_insert(filename, CACHE_IDENTITY, filename, sbuf, buf, hdrlen, srcfd);
+	if (e != NULL) {
+	    close_or_die(srcfd);
+	    stats_mark(STATS_IO);
+	    request_send_cached(fd, e, keep_alive, rp, filename);
+	    return keep_alive;
+	}
+	// could not read it whole; fall back to an uncached send
+    }
+    
+    hdrlen = request_static_header(buf, filesize, request_get_filetype(filename), rp, NULL);
+    return request_send_file(fd, srcfd, buf, hdrlen, keep_alive, rp ? 206 : 200,
+			     rp ? rp->first : 0, rp ? rp->last + 1 : filesize);
+}
+
+//
+// The /__stats page: the same report as the periodic dump, as plain text
+//
+void request_serve_stats(int fd, int keep_alive) {
+    char hdr[MAXBUF], body[4096];
+    int bodylen = stats_render(body, sizeof(body));
+    int hdrlen = request_static_header(hdr, bodylen, "text/plain", NULL, NULL);
+    char *conn = request_conn_header(keep_alive);
+    struct iovec iov[3];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hdrlen;
+    iov[1].iov_base = conn;
+    iov[1].iov_len = strlen(conn);
+    iov[2].iov_base = body;
+    iov[2].iov_len = bodylen;
+    request_writev(fd, iov, 3);
+    stats_response(200, hdrlen + iov[1].iov_len + bodylen);
 }
 
-// handle a request
-void request_handle(int fd) {
-    int is_static;
+static int request_handle_one(conn_t *c) {
+    int keep_alive, fd = c->fd;
     struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
+    cache_entry_t *e;
+    request_t r;
     
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
+    // consume the head up front; pipelined requests may follow it
+    char *head = c->buf + c->start;
+    int headlen = request_ready(c);
+    assert(headlen > 0);
+    c->start += headlen;
     
-    if (strcasecmp(method, "GET")) {
-	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
-	return;
+    // the request line, as it goes into the access log
+    char *eol = memchr(head, '\n', headlen);
+    stats_request_line(head, eol - head - (eol > head && eol[-1] == '\r'));
+    
+    int rc = request_parse(head, headlen, &r);
+    stats_mark(STATS_PARSE);
+    if (rc < 0) {
+	request_error(fd, ERROR_BAD_REQUEST, 0);
+	return 0;
     }
-    request_read_headers(fd);
     
-    is_static = request_parse_uri(uri, filename, cgiargs);
+    if (!str_eq(r.method, "GET", 3)) {
+	// there may be a body we do not know how to skip, so hang up after this
+	request_error(fd, ERROR_NOT_IMPLEMENTED, 0);
+	return 0;
+    }
+    keep_alive = r.keep_alive && request_keep_alive;
+    int is_static = request_is_static(r.uri);
+    
+    // The views point into our own buffer, past the consumed head, so they
+    // can be terminated in place: the path and query are each followed by
+    // a '?' or a blank.  Paths are looked up relative to the root, with
+    // the leading '/' dropped.
+    char *filename = r.path.p + 1, *cgiargs = r.query.p;
+    r.path.p[r.path.len] = '\0';
+    r.query.p[r.query.len] = '\0';
+    char index_name[CONN_BUFSIZE + sizeof("index.html")];
+    if (r.path.p[r.path.len - 1] == '/' && is_static) {
+	memcpy(index_name, filename, r.path.len - 1);
+	strcpy(index_name + r.path.len - 1, "index.html");
+	filename = index_name;
+    }
+    
+    if (is_static && strcmp(r.path.p, "/__stats") == 0) {
+	request_serve_stats(fd, keep_alive);
+	return keep_alive;
+    }
+    // a Range: is always served of the file as it is
+    int gzip = is_static && r.gzip && r.range.len == 0 &&
+	request_compressible(request_get_filetype(filename));
+    if (is_static && (e = cache_lookup(filename, gzip ? CACHE_GZIP : CACHE_IDENTITY)) != NULL) {
+	stats_mark(STATS_IO);
+	range_t range, *rp = NULL;
+	switch (request_resolve_range(r.range, e->size - e->hdrlen, &range)) {
+	case RANGE_OK:
+	    rp = &range;
+	    break;
+	case RANGE_UNSATISFIABLE:
+	    request_range_error(fd, e->size - e->hdrlen, keep_alive);
+	    cache_release(e);
+	    return keep_alive;
+	}
+	request_send_cached(fd, e, keep_alive, rp, filename);
+	return keep_alive;
+    }
     if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
-	return;
+	stats_mark(STATS_IO);
+	request_error(fd, ERROR_NOT_FOUND, keep_alive);
+	return keep_alive;
     }
     
     if (is_static) {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
-	    return;
+	    stats_mark(STATS_IO);
+	    request_error(fd, ERROR_FORBIDDEN, keep_alive);
+	    return keep_alive;
 	}
-	request_serve_static(fd, filename, sbuf.st_size);
+	return request_serve_static(fd, filename, &sbuf, keep_alive, r.range, gzip);
     } else {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
-	    return;
+	    stats_mark(STATS_IO);
+	    request_error(fd, ERROR_FORBIDDEN_CGI, keep_alive);
+	    return keep_alive;
 	}
+	// the CGI program writes the rest of the response, and we cannot tell
+	// where it ends, so dynamic responses always close the connection
 	request_serve_dynamic(fd, filename, cgiargs);
+	return 0;
+    }
+}
+
+//
+// Handles the request at the front of the connection buffer, which must
+// hold a complete head (see request_ready()).  Returns 1 if the connection
+// can be kept open for another request.
+//
+int request_handle(conn_t *c) {
+    stats_begin(c->arrived);
+    int keep_alive = request_handle_one(c);
+    stats_end();
+    return keep_alive;
+}
+
+//
+// Serves requests from one connection, in order, until the client closes
+// it, asks for it to be closed, or leaves it idle for request_idle_timeout.
+// With request_keep_alive off, that is after the first request.
+//
+void request_serve_connection(int fd) {
+    conn_t *c = malloc(sizeof(conn_t));
+    assert(c != NULL);
+    c->fd = fd;
+    c->start = c->end = 0;
+    
+    while (1) {
+	while (!request_ready(c)) {
+	    if (request_fill(c, request_idle_timeout) > 0)
+		continue;
+	    if (c->end - c->start == CONN_BUFSIZE)
+		request_error(fd, ERROR_HEAD_TOO_LARGE, 0);
+	    free(c);
+	    return;
+	}
+	if (!request_handle(c))
+	    break;
     }
+    free(c);
 }
@@ -1,5 +1,99 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void request_handle(int fd);
+// how request_serve_static() moves file contents onto the socket
+#define STATIC_SENDFILE (0)  // writev() for small files, sendfile() otherwise
+#define STATIC_MMAP     (1)  // the original mmap() + write() path
+
+extern int request_static_mode;
+
+// how long (in ms) a kept-alive connection may sit idle between requests
+extern int request_idle_timeout;
+
+// whether connections may be kept alive at all; the single accept loop
+// turns this off, since it serves one connection at a time
+extern int request_keep_alive;
+
+// If a thread sets this, responses for cached files are handed to it rather
+// than written out: it gets the iovecs, which it must copy along with the
+// header in iov[0] (a 206 header is on the caller's stack), and the
+// reference on the cache entry, to be dropped once they are sent.  It
+// returns 0 if it cannot take them after all.  See listener.c.
+struct cache_entry;
+struct iovec;
+extern __thread int (*request_send_async)(int fd, struct iovec *iov, int iovcnt,
+					   struct cache_entry *e);
+
+// Likewise, if set, file bodies too big for the cache are handed to this
+// once their header is out: it takes over srcfd and sends srcfd[offset,
+// end) one request_stream_window() at a time, as the client reads it.
+extern __thread int (*request_stream_async)(int fd, int srcfd, off_t offset, off_t end);
+
+// And if set, dynamic requests are handed to this, which takes over fd and
+// must see to it that request_run_dynamic() is called and fd then closed.
+extern __thread int (*request_dynamic_async)(int fd, char *filename, char *cgiargs);
+
+#define CONN_BUFSIZE (8192)
+
+//
+// Per-connection input buffer.  Requests are parsed straight out of it, so
+// when a client pipelines several, one read() can pick them all up.
+//
+typedef struct conn {
+    int fd;
+    int start, end;         // unparsed input is buf[start, end)
+    double arrived;         // when the last read() returned (stats_now())
+    char buf[CONN_BUFSIZE];
+} conn_t;
+
+//
+// A request parsed in place: every field is a view into the connection
+// buffer, not a copy
+//
+typedef struct str {
+    char *p;
+    int len;
+} str_t;
+
+typedef struct request {
+    str_t method, uri, version;
+    str_t path, query;      // uri split at the '?'
+    str_t range;            // the Range: header's value, if any
+    int keep_alive;
+    int gzip;               // does Accept-Encoding: allow gzip?
+} request_t;
+
+//
+// The bytes of a file a Range: header asks for, first and last inclusive
+//
+typedef struct range {
+    off_t first, last;
+} range_t;
+
+// what request_resolve_range() found
+#define RANGE_NONE          (0)  // no usable Range: header; send it all
+#define RANGE_OK            (1)
+#define RANGE_UNSATISFIABLE (2)  // 416
+
+// canned error responses for request_error()
+#define ERROR_BAD_REQUEST     (0)  // 400
+#define ERROR_FORBIDDEN       (1)  // 403, static
+#define ERROR_FORBIDDEN_CGI   (2)  // 403, dynamic
+#define ERROR_NOT_FOUND       (3)  // 404
+#define ERROR_HEAD_TOO_LARGE  (4)  // 431
+#define ERROR_RANGE           (5)  // 416
+#define ERROR_CGI_FAILED      (6)  // 500
+#define ERROR_NOT_IMPLEMENTED (7)  // 501
+
+void request_error(int fd, int error, int keep_alive);
+int request_parse(char *head, int headlen, request_t *r);
+int request_resolve_range(str_t spec, off_t size, range_t *r);
+int request_run_dynamic(int fd, char *filename, char *cgiargs);
+ssize_t request_stream_window(int fd, int srcfd, off_t *offset, off_t end);
+int request_ready(conn_t *c);
+void request_compact(conn_t *c);
+int request_fill(conn_t *c, int timeout_ms);
+int request_handle(conn_t *c);
+void request_serve_connection(int fd);
 
 #endif // __REQUEST_H__
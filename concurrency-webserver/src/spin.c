@@ -7,10 +7,17 @@
 
 #define MAXBUF (8192)
 
+// see cgi_pool.h in the server
+#define CGI_POOL_MAGIC (0x4f434749)
+#define CGI_POOL_ENV   "OSTEP_CGI_PERSISTENT"
+
 //
 // This program is intended to help you test your web server.
 // You can use it to test that you are correctly having multiple threads
 // handling http requests.
+//
+// Run with OSTEP_CGI_PERSISTENT set (as wserver -w does), it stays up and
+// answers one request after another over stdin/stdout instead.
 // 
 
 double get_seconds() {
@@ -20,12 +27,13 @@ double get_seconds() {
     return (double) ((double)t.tv_sec + (double)t.tv_usec / 1e6);
 }
 
-
-int main(int argc, char *argv[]) {
-    // Extract arguments
+//
+// Does the work for one request; fills in the response (everything after
+// the server's part of the header) and returns its length
+//
+int spin(char *buf, char *response) {
     double spin_for = 0.0;
-    char *buf;
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
+    if (buf != NULL) {
 	// just expecting a single number
 	spin_for = (double) atoi(buf);
     }
@@ -37,16 +45,70 @@ int main(int argc, char *argv[]) {
     
     /* Make the response body */
     char content[MAXBUF];
-    sprintf(content, "<p>Welcome to the CGI program (%s)</p>\r\n", buf);
-    sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
-    sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
+    int n = 0;
+    n += sprintf(content + n, "<p>Welcome to the CGI program (%s)</p>\r\n", buf);
+    n += sprintf(content + n, "<p>My only purpose is to waste time on the server!</p>\r\n");
+    n += sprintf(content + n, "<p>I spun for %.2f seconds</p>\r\n", t2 - t1);
     
     /* Generate the HTTP response */
-    printf("Content-Length: %lu\r\n", strlen(content));
-    printf("Content-Type: text/html\r\n\r\n");
-    printf("%s", content);
+    return sprintf(response, ""
+		   "Content-Length: %d\r\n"
+		   "Content-Type: text/html\r\n\r\n"
+		   "%s", n, content);
+}
+
+int read_full(void *buf, int len) {
+    char *p = buf;
+    while (len > 0) {
+	int rc = read(STDIN_FILENO, p, len);
+	if (rc <= 0)
+	    return -1;
+	p += rc;
+	len -= rc;
+    }
+    return 0;
+}
+
+int write_full(void *buf, int len) {
+    char *p = buf;
+    while (len > 0) {
+	int rc = write(STDOUT_FILENO, p, len);
+	if (rc <= 0)
+	    return -1;
+	p += rc;
+	len -= rc;
+    }
+    return 0;
+}
+
+//
+// Persistent mode: greet the server, then serve requests until it hangs up
+//
+void serve_persistent() {
+    char query[MAXBUF], response[2 * MAXBUF];
+    unsigned int len = CGI_POOL_MAGIC;
+    if (write_full(&len, sizeof(len)) < 0)
+	exit(1);
+    while (read_full(&len, sizeof(len)) == 0) {
+	if (len >= MAXBUF || read_full(query, len) < 0)
+	    exit(1);
+	query[len] = '\0';
+	len = spin(query, response);
+	if (write_full(&len, sizeof(len)) < 0 || write_full(response, len) < 0)
+	    exit(1);
+    }
+    exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    if (getenv(CGI_POOL_ENV) != NULL)
+	serve_persistent();
+    
+    // Extract arguments
+    char response[2 * MAXBUF];
+    int len = spin(getenv("QUERY_STRING"), response);
+    fwrite(response, 1, len, stdout);
     fflush(stdout);
     
     exit(0);
 }
-
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "io_helper.h"
+#include "cache.h"
+#include "stats.h"
+
+int stats_access_log = 1;
+
+#define LOG_LINE_MAX (100)
+#define LOG_RING     (4096)  // records per thread; a power of two
+#define LOG_BATCH    (65536)
+
+typedef struct log_record {
+    int status;
+    int len;
+    long bytes;
+    unsigned long usec;
+    char line[LOG_LINE_MAX];
+} log_record_t;
+
+typedef struct stats_thread {
+    // written only by the owning thread
+    unsigned long requests, bytes;
+    unsigned long status[6];        // by hundreds: status[2] counts 2xx
+    histogram_t phase[STATS_PHASES];
+    double start, last;             // the request in progress
+    log_record_t cur;
+
+    // access log ring: the owner advances head, the log thread tail
+    unsigned long head, tail, dropped;
+    log_record_t ring[LOG_RING];
+
+    struct stats_thread *next;
+} stats_thread_t;
+
+//
+// Records are allocated on a thread's first request and never freed, so
+// totals never go backwards; the server's threads live as long as it does
+//
+static stats_thread_t *all_threads = NULL;
+static pthread_mutex_t all_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_thread_t *self = NULL;
+
+static char *phase_names[STATS_PHASES] = { "queue", "parse", "io", "send", "total" };
+
+static stats_thread_t *stats_self() {
+    if (self != NULL)
+	return self;
+    self = calloc(1, sizeof(stats_thread_t));
+    assert(self != NULL);
+    for (int i = 0; i < STATS_PHASES; i++)
+	hist_init(&self->phase[i]);
+    assert(pthread_mutex_lock(&all_lock) == 0);
+    self->next = all_threads;
+    __atomic_store_n(&all_threads, self, __ATOMIC_RELEASE);
+    assert(pthread_mutex_unlock(&all_lock) == 0);
+    return self;
+}
+
+double stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static unsigned long usec(double seconds) {
+    return seconds > 0 ? (unsigned long) (seconds * 1e6) : 0;
+}
+
+void stats_begin(double arrived) {
+    stats_thread_t *s = stats_self();
+    s->start = s->last = arrived;
+    s->cur.status = 0;
+    s->cur.bytes = 0;
+    s->cur.len = 0;
+    stats_mark(STATS_QUEUE);
+}
+
+void stats_mark(int phase) {
+    stats_thread_t *s = self;
+    double now = stats_now();
+    hist_record(&s->phase[phase], usec(now - s->last));
+    s->last = now;
+}
+
+void stats_request_line(char *line, int len) {
+    stats_thread_t *s = self;
+    if (len > LOG_LINE_MAX)
+	len = LOG_LINE_MAX;
+    memcpy(s->cur.line, line, len);
+    s->cur.len = len;
+}
+
+// also called for errors sent outside of any request
+void stats_response(int status, long bytes) {
+    stats_thread_t *s = stats_self();
+    s->cur.status = status;
+    s->cur.bytes += bytes;
+}
+
+void stats_end() {
+    stats_thread_t *s = self;
+    // whatever came after the last mark went into sending the response
+    stats_mark(STATS_SEND);
+    s->cur.usec = usec(s->last - s->start);
+    hist_record(&s->phase[STATS_TOTAL], s->cur.usec);
+    s->requests++;
+    s->bytes += s->cur.bytes;
+    s->status[s->cur.status / 100 < 6 ? s->cur.status / 100 : 0]++;
+
+    if (!stats_access_log)
+	return;
+    unsigned long tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+    if (s->head - tail == LOG_RING) {
+	s->dropped++;
+	return;
+    }
+    s->ring[s->head % LOG_RING] = s->cur;
+    __atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELEASE);
+}
+
+//
+// Empties every thread's ring into one buffer, written out whenever it
+// fills up.  Failing to write the log is not worth stopping the server for.
+//
+static void log_drain(char *buf) {
+    int n = 0;
+    stats_thread_t *s = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE);
+    for (; s != NULL; s = s->next) {
+	unsigned long head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+	for (unsigned long i = s->tail; i < head; i++) {
+	    log_record_t *r = &s->ring[i % LOG_RING];
+	    if (n > LOG_BATCH - LOG_LINE_MAX - 64) {
+		if (write(STDOUT_FILENO, buf, n) < 0)
+		    ;
+		n = 0;
+	    }
+	    n += sprintf(buf + n, "%.*s %d %ld %luus\n", r->len, r->line,
+			 r->status, r->bytes, r->usec);
+	}
+	__atomic_store_n(&s->tail, head, __ATOMIC_RELEASE);
+    }
+    if (n > 0 && write(STDOUT_FILENO, buf, n) < 0)
+	;
+}
+
+static void *log_run(void *arg) {
+    char *buf = malloc(LOG_BATCH);
+    assert(buf != NULL);
+    struct timespec ts = { 0, STATS_LOG_FLUSH_MS * 1000000L };
+    while (1) {
+	nanosleep(&ts, NULL);
+	log_drain(buf);
+    }
+    return NULL;
+}
+
+static void *dump_run(void *arg) {
+    int secs = *(int *) arg;
+    while (1) {
+	sleep(secs);
+	stats_print(stderr);
+    }
+    return NULL;
+}
+
+void stats_init(int dump_secs) {
+    pthread_t t;
+    // the threads inherit a mask blocking everything, so that signals meant
+    // for the server (SIGUSR1) are never delivered to them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (stats_access_log) {
+	assert(pthread_create(&t, NULL, log_run, NULL) == 0);
+	assert(pthread_detach(t) == 0);
+    }
+    if (dump_secs > 0) {
+	static int secs;
+	secs = dump_secs;
+	assert(pthread_create(&t, NULL, dump_run, &secs) == 0);
+	assert(pthread_detach(t) == 0);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+int stats_render(char *buf, int size) {
+    histogram_t *phase = malloc(STATS_PHASES * sizeof(histogram_t));
+    assert(phase != NULL);
+    for (int i = 0; i < STATS_PHASES; i++)
+	hist_init(&phase[i]);
+    unsigned long requests = 0, bytes = 0, dropped = 0, status[6] = { 0 };
+
+    stats_thread_t *s = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE);
+    for (; s != NULL; s = s->next) {
+	requests += s->requests;
+	bytes += s->bytes;
+	dropped += s->dropped;
+	for (int i = 0; i < 6; i++)
+	    status[i] += s->status[i];
+	for (int i = 0; i < STATS_PHASES; i++)
+	    hist_merge(&phase[i], &s->phase[i]);
+    }
+
+    cache_stats_t c;
+    cache_get_stats(&c);
+    int n = snprintf(buf, size,
+		     "requests: %lu\n"
+		     "responses: 2xx %lu 3xx %lu 4xx %lu 5xx %lu\n"
+		     "bytes sent: %lu\n"
+		     "access log lines dropped: %lu\n"
+		     "cache: %lu hits %lu misses (%lu stale) %lu inserts "
+		     "%lu evictions, %lu entries using %zu of %zu bytes\n"
+		     "%-8s %10s %8s %8s %8s %8s %8s %8s\n",
+		     requests, status[2], status[3], status[4], status[5], bytes, dropped,
+		     c.hits, c.misses, c.stale, c.inserts, c.evictions, c.entries, c.bytes, c.budget,
+		     "us", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < STATS_PHASES && n < size; i++) {
+	histogram_t *h = &phase[i];
+	n += snprintf(buf + n, size - n, "%-8s %10lu %8.0f %8lu %8lu %8lu %8lu %8lu\n",
+		      phase_names[i], h->total, hist_mean(h), hist_percentile(h, 0.50),
+		      hist_percentile(h, 0.90), hist_percentile(h, 0.99),
+		      hist_percentile(h, 0.999), h->max);
+    }
+    free(phase);
+    return n < size ? n : size - 1;
+}
+
+void stats_print(FILE *f) {
+    char buf[4096];
+    stats_render(buf, sizeof(buf));
+    fputs(buf, f);
+}
@@ -0,0 +1,53 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include "histogram.h"
+
+//
+// Request statistics and the access log.
+//
+// Each thread that serves requests records into its own counters and
+// histograms, so recording takes no lock and touches no shared cache
+// lines; the per-thread records are only added up when a report is asked
+// for (the /__stats page, the periodic dump, SIGUSR1).  Reports do not stop
+// the writers, so they may be a request or so behind.
+//
+// A request's time is split into phases.  stats_begin() starts the clock
+// from when the request's bytes were read, and each stats_mark() charges
+// the time since the previous mark to a phase; a phase a request never
+// reaches is not recorded for it.
+//
+#define STATS_QUEUE  (0)  // waiting to be picked up after it was read
+#define STATS_PARSE  (1)  // parsing the request head
+#define STATS_IO     (2)  // finding and reading the file, or running the CGI program
+#define STATS_SEND   (3)  // writing the response
+#define STATS_TOTAL  (4)  // all of the above
+#define STATS_PHASES (5)
+
+//
+// The access log line for each request goes into a ring buffer owned by
+// its thread.  A background thread empties all the rings every
+// STATS_LOG_FLUSH_MS and writes the lines to stdout in large batches.  When
+// a ring is full the line is dropped, and counted, rather than waited for.
+//
+#define STATS_LOG_FLUSH_MS (20)
+
+extern int stats_access_log;    // 0 turns the access log off
+
+// starts the log thread and, if dump_secs > 0, a thread that prints a
+// report to stderr that often
+void stats_init(int dump_secs);
+
+double stats_now();
+void stats_begin(double arrived);
+void stats_mark(int phase);
+void stats_request_line(char *line, int len);
+void stats_response(int status, long bytes);
+void stats_end();
+
+// writes a plain-text report into buf; returns its length
+int stats_render(char *buf, int size);
+void stats_print(FILE *f);
+
+#endif // __STATS_H__
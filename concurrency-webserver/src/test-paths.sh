@@ -0,0 +1,50 @@
+#! /bin/bash
+#
+# Paths that would reach outside the document root must be refused with
+# 400 before anything is opened: an absolute one ("//etc/hostname") and
+# any with a ".." segment.  Names that merely contain dots still work.
+#
+# usage: ./test-paths.sh [port]
+
+port=${1:-10008}
+
+if ! [[ -x wserver && -x wclient ]]; then
+    echo "run make first"
+    exit 1
+fi
+
+root=$(mktemp -d)
+mkdir $root/sub
+echo hello > $root/hello.txt
+echo dots > $root/a..b
+trap 'rm -rf $root' EXIT
+
+./wserver -d $root -p $port > /dev/null &
+server=$!
+sleep 0.5
+
+failed=0
+expect() {
+    status=$(./wclient localhost $port "$2" | head -1 | awk '{ print $3 }')
+    if [[ $status != $1 ]]; then
+	echo "FAIL: $2 gave $status, wanted $1"
+	failed=1
+    fi
+}
+
+expect 200 /hello.txt
+expect 200 /a..b
+expect 400 //etc/hostname
+expect 400 //hello.txt
+expect 400 /..
+expect 400 /../etc/hostname
+expect 400 /sub/../hello.txt
+expect 400 /sub/..
+expect 400 /sub/../../etc/hostname
+
+kill $server
+wait $server 2> /dev/null
+if (( failed == 0 )); then
+    echo "all passed"
+fi
+exit $failed
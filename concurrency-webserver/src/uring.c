@@ -0,0 +1,113 @@
+#include <sys/syscall.h>
+#include "io_helper.h"
+#include "uring.h"
+
+static int uring_enter(uring_t *u, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params *p, unsigned flags) {
+    memset(p, 0, sizeof(*p));
+    p->flags = flags;
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_init(uring_t *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+
+    // only this thread submits, and completion work is deferred until it
+    // next waits in io_uring_enter(), so it is done in one batch instead of
+    // interrupting the loop; older kernels know neither flag
+    u->fd = uring_setup(entries, &p, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+    if (u->fd < 0 && errno == EINVAL)
+	u->fd = uring_setup(entries, &p, IORING_SETUP_COOP_TASKRUN);
+    if (u->fd < 0 && errno == EINVAL)
+	u->fd = uring_setup(entries, &p, 0);
+    if (u->fd < 0)
+	return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+	close(u->fd);
+	errno = ENOSYS;
+	return -1;
+    }
+
+    // the submission and completion rings share one mapping
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || u->sqes == MAP_FAILED) {
+	close(u->fd);
+	return -1;
+    }
+    u->rings = rings;
+    u->rings_size = size;
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_head = (unsigned *) (rings + p.sq_off.head);
+    u->sq_tail = (unsigned *) (rings + p.sq_off.tail);
+    u->sq_array = (unsigned *) (rings + p.sq_off.array);
+    u->sq_mask = *(unsigned *) (rings + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *) (rings + p.cq_off.head);
+    u->cq_tail = (unsigned *) (rings + p.cq_off.tail);
+    u->cq_mask = *(unsigned *) (rings + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+    // SQE i always sits in slot i
+    for (unsigned i = 0; i < p.sq_entries; i++)
+	u->sq_array[i] = i;
+
+    return 0;
+}
+
+void uring_exit(uring_t *u) {
+    munmap(u->rings, u->rings_size);
+    munmap(u->sqes, u->sqes_size);
+    close(u->fd);
+}
+
+int uring_supports(uring_t *u, int opcode) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = calloc(1, size);
+    assert(p != NULL);
+    int ok = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, p, 256) == 0 &&
+	opcode <= p->last_op && (p->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+	int rc = uring_enter(u, u->queued, 0, 0);
+	assert(rc >= 0);
+	u->queued = 0;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+void uring_submit_and_wait(uring_t *u) {
+    int rc;
+    while ((rc = uring_enter(u, u->queued, 1, IORING_ENTER_GETEVENTS)) < 0 && errno == EINTR)
+	;
+    assert(rc >= 0);
+    u->queued = 0;
+}
+
+struct io_uring_cqe *uring_cqe(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+	return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
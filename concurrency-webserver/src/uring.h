@@ -0,0 +1,40 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+
+//
+// Just enough of io_uring for the listener's event loop, on top of the raw
+// system calls (no liburing): one submission and one completion queue.
+//
+// A uring_t belongs to one thread.
+//
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;                // SQEs not yet handed to the kernel
+    void *rings;
+    size_t rings_size, sqes_size;
+} uring_t;
+
+// returns -1 (with errno set) if the kernel has no usable io_uring
+int uring_init(uring_t *u, unsigned entries);
+void uring_exit(uring_t *u);
+
+// whether the kernel knows the IORING_OP_ opcode (but not which flags)
+int uring_supports(uring_t *u, int opcode);
+
+// a zeroed SQE, submitting what is queued first if the queue is full
+struct io_uring_sqe *uring_sqe(uring_t *u);
+
+// submits what is queued and waits for at least one completion
+void uring_submit_and_wait(uring_t *u);
+
+// the next completion, or NULL; pass it to uring_cqe_seen() when done
+struct io_uring_cqe *uring_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+
+#endif // __URING_H__
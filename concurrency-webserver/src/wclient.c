@@ -7,6 +7,27 @@
 // Sends one HTTP request to the specified HTTP server.
 // Prints out the HTTP response.
 //
+// Given several filenames (and/or -n to repeat them), sends them all over
+// one keep-alive connection, reconnecting only when the server closes it;
+// -x opens a new connection for every request instead, so the two can be
+// compared.  -q prints only the total time and request rate.
+//
+// Load generator mode (any of -c, -d, -r, -f):
+//      client -c conns [-d secs] [-r rate] [-f urifile] [-x] host port [filename ...]
+//
+// Runs conns connections, each in its own thread, for secs seconds
+// (default 10) or, with -n, for that many requests in total.  Without -r
+// the load is closed-loop: every connection sends its next request as soon
+// as the previous answer is in.  With -r the load is open-loop: requests
+// are started on a fixed schedule adding up to rate per second, whether or
+// not the server keeps up, and latency is measured from when each request
+// was due, so a stalled server shows up in the tail instead of just
+// slowing the client down.  URIs are picked at random from the filenames
+// given, or from urifile (one per line; repeat a line to weight it).
+// Reports throughput and the latency distribution.  A refused connect or
+// a connection reset before the answer is counted as a connection error,
+// and the next request opens a new connection.
+//
 // For testing your server, you will want to modify this client.  
 // For example:
 // You may want to make this multi-threaded so that you can 
@@ -19,74 +40,415 @@
 // When we test your server, we will be using modifications to this client.
 //
 
+#include <pthread.h>
+#include <time.h>
 #include "io_helper.h"
+#include "histogram.h"
 
 #define MAXBUF (8192)
 
 //
-// Send an HTTP request for the specified file 
+// Buffered reader for the response stream; responses are delimited by
+// Content-Length, so one connection can carry several of them
 //
-void client_send(int fd, char *filename) {
+typedef struct reader {
+    int fd;
+    int start, end;
+    char buf[MAXBUF];
+} reader_t;
+
+// a reset connection ends the stream like a closed one
+int reader_fill(reader_t *r) {
+    if (r->start == r->end)
+	r->start = r->end = 0;
+    int rc;
+    while ((rc = read(r->fd, r->buf + r->end, MAXBUF - r->end)) < 0 && errno == EINTR)
+	;
+    if (rc < 0)
+	return 0;
+    r->end += rc;
+    return rc;
+}
+
+// like readline(), but from the buffer
+int reader_line(reader_t *r, char *line, int maxlen) {
+    int n = 0;
+    while (n < maxlen - 1) {
+	if (r->start == r->end && reader_fill(r) == 0)
+	    break;
+	char c = r->buf[r->start++];
+	line[n++] = c;
+	if (c == '\n')
+	    break;
+    }
+    line[n] = '\0';
+    return n;
+}
+
+// hands up to len bytes of body to the caller; 0 at end of stream
+int reader_body(reader_t *r, char **p, int len) {
+    if (r->start == r->end && reader_fill(r) == 0)
+	return 0;
+    int n = r->end - r->start;
+    if (n > len)
+	n = len;
+    *p = r->buf + r->start;
+    r->start += n;
+    return n;
+}
+
+//
+// Send an HTTP request for the specified file; returns -1 if the
+// connection is gone (without the SIGPIPE that would end the client)
+//
+int client_send(int fd, char *hostname, char *filename, int keep_alive) {
     char buf[MAXBUF];
-    char hostname[MAXBUF];
-    
-    gethostname_or_die(hostname, MAXBUF);
     
     /* Form and send the HTTP request */
-    sprintf(buf, "GET %s HTTP/1.1\n", filename);
-    sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
-    write_or_die(fd, buf, strlen(buf));
+    snprintf(buf, MAXBUF, "GET %s HTTP/1.1\r\nhost: %s\r\n%s\r\n", filename, hostname,
+	     keep_alive ? "" : "Connection: close\r\n");
+    int len = strlen(buf);
+    for (int done = 0, rc; done < len; done += rc)
+	if ((rc = send(fd, buf + done, len - done, MSG_NOSIGNAL)) < 0)
+	    return -1;
+    return 0;
 }
 
 //
-// Read the HTTP response and print it out
+// Read one HTTP response and print it out (unless quiet).
+// Returns 1 if the connection can carry another request; the status code
+// goes in *status (0 if no response arrived).
 //
-void client_print(int fd) {
+int client_print(reader_t *r, int quiet, int *status) {
     char buf[MAXBUF];  
-    int n;
+    int n, length = -1, keep_alive = 1;
     
     // Read and display the HTTP Header 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = reader_line(r, buf, MAXBUF);
+    *status = 0;
+    if (n > 0 && strncmp(buf, "HTTP/1.0", 8) == 0)
+	keep_alive = 0;
+    if (n > 0)
+	sscanf(buf, "HTTP/%*s %d", status);
     while (strcmp(buf, "\r\n") && (n > 0)) {
-	printf("Header: %s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	if (!quiet)
+	    printf("Header: %s", buf);
+	sscanf(buf, "Content-Length: %d ", &length);
+	if (strncasecmp(buf, "Connection: close", 17) == 0)
+	    keep_alive = 0;
+	n = reader_line(r, buf, MAXBUF);
+    }
+    if (n == 0)
+	return 0;
+    
+    // Read and display the HTTP Body; without a length, it runs to EOF
+    char *p;
+    if (length < 0) {
+	length = INT32_MAX;
+	keep_alive = 0;
+    }
+    while (length > 0 && (n = reader_body(r, &p, length)) > 0) {
+	if (!quiet)
+	    fwrite(p, 1, n, stdout);
+	length -= n;
+    }
+    return keep_alive && length == 0;
+}
+
+double client_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+//
+// Load generator
+//
+
+typedef struct load {
+    struct sockaddr_in addr;
+    char hostname[MAXBUF];
+    char **uris;
+    int nuris;
+    int keep_alive;
+    int conns;
+    double start, stop;     // stop == 0: run until each thread did its quota
+    double interval;        // per connection, for open-loop; 0 = closed-loop
+} load_t;
+
+typedef struct load_thread {
+    load_t *load;
+    int id;
+    long quota;             // requests to send when running by count
+    pthread_t thread;
+    unsigned int seed;
+    // results
+    histogram_t latency;    // microseconds
+    long requests, ok, failed, errors, connects;
+} load_thread_t;
+
+// returns -1 if the server refused the connection
+int load_connect(load_t *l) {
+    int fd = socket_or_die(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (sockaddr_t *) &l->addr, sizeof(l->addr)) < 0) {
+	close_or_die(fd);
+	return -1;
+    }
+    int one = 1;
+    setsockopt_or_die(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+void load_sleep_until(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) t;
+    ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+	;
+}
+
+void *load_run(void *arg) {
+    load_thread_t *t = arg;
+    load_t *l = t->load;
+    reader_t *r = malloc(sizeof(reader_t));
+    assert(r != NULL);
+    r->fd = -1;
+    hist_init(&t->latency);
+    
+    // open-loop connections are staggered across one interval
+    double due = l->start + l->interval * t->id / l->conns;
+    for (long i = 0; l->stop > 0 || i < t->quota; i++) {
+	if (l->interval > 0) {
+	    due += l->interval;
+	    load_sleep_until(due);
+	} else {
+	    due = client_seconds();
+	}
+	// stop on the clock, not the schedule: a server that fell behind
+	// leaves a backlog that is not worth draining.  Requests in flight at
+	// the deadline are finished, so the server is never left writing to a
+	// closed connection.
+	if (l->stop > 0 && client_seconds() >= l->stop)
+	    break;
+	
+	if (r->fd < 0) {
+	    r->fd = load_connect(l);
+	    r->start = r->end = 0;
+	    t->connects += r->fd >= 0;
+	}
+	char *uri = l->uris[rand_r(&t->seed) % l->nuris];
+	int status = 0, more = 0;
+	if (r->fd >= 0 && client_send(r->fd, l->hostname, uri, l->keep_alive) == 0)
+	    more = client_print(r, 1, &status);
+	double done = client_seconds();
 	
-	// If you want to look for certain HTTP tags... 
-	// int length = 0;
-	//if (sscanf(buf, "Content-Length: %d ", &length) == 1) {
-	//    printf("Length = %d\n", length);
-	//}
+	// no status: refused, reset or closed before the answer; those come
+	// back fast and would only flatter the latency figures
+	t->requests++;
+	if (status == 0) {
+	    t->errors++;
+	} else {
+	    if (status >= 200 && status < 400)
+		t->ok++;
+	    else
+		t->failed++;
+	    hist_record(&t->latency, (unsigned long) ((done - due) * 1e6));
+	}
+	if (r->fd >= 0 && (!more || !l->keep_alive)) {
+	    close_or_die(r->fd);
+	    r->fd = -1;
+	}
     }
+    if (r->fd >= 0)
+	close_or_die(r->fd);
+    free(r);
+    return NULL;
+}
+
+// reads one URI per line; blank lines and lines starting with # are skipped
+int load_read_uris(char *filename, char ***uris) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "wclient: cannot open %s\n", filename);
+	exit(1);
+    }
+    int n = 0, cap = 16;
+    *uris = malloc(cap * sizeof(char *));
+    char line[MAXBUF];
+    while (fgets(line, MAXBUF, f) != NULL) {
+	line[strcspn(line, "\r\n")] = '\0';
+	if (line[0] == '\0' || line[0] == '#')
+	    continue;
+	if (n == cap) {
+	    cap *= 2;
+	    *uris = realloc(*uris, cap * sizeof(char *));
+	}
+	(*uris)[n++] = strdup(line);
+    }
+    fclose(f);
+    return n;
+}
+
+void load_report(load_thread_t *threads, int nthreads, double elapsed) {
+    histogram_t *all = malloc(sizeof(histogram_t));
+    assert(all != NULL);
+    hist_init(all);
+    long requests = 0, ok = 0, failed = 0, errors = 0, connects = 0;
+    for (int i = 0; i < nthreads; i++) {
+	hist_merge(all, &threads[i].latency);
+	requests += threads[i].requests;
+	ok += threads[i].ok;
+	failed += threads[i].failed;
+	errors += threads[i].errors;
+	connects += threads[i].connects;
+    }
+    printf("%ld requests (%ld ok, %ld failed, %ld connection errors) over %ld connections "
+	   "in %.2f s\n", requests, ok, failed, errors, connects, elapsed);
+    printf("throughput: %.0f requests/s\n", (requests - errors) / elapsed);
+    printf("latency (us): mean %.0f  p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+	   hist_mean(all), hist_percentile(all, 0.50), hist_percentile(all, 0.90),
+	   hist_percentile(all, 0.99), hist_percentile(all, 0.999), all->max);
+    free(all);
+}
+
+void load_main(char *host, int port, int conns, double secs, long total, double rate,
+	       char *urifile, char **files, int nfiles, int keep_alive) {
+    load_t *l = calloc(1, sizeof(load_t));
+    assert(l != NULL);
+    
+    // resolve once; gethostbyname() is not safe to call from the threads
+    struct hostent *hp = gethostbyname_or_die(host);
+    l->addr.sin_family = AF_INET;
+    memcpy(&l->addr.sin_addr.s_addr, hp->h_addr, hp->h_length);
+    l->addr.sin_port = htons(port);
+    gethostname_or_die(l->hostname, MAXBUF);
+    
+    if (urifile != NULL) {
+	l->nuris = load_read_uris(urifile, &l->uris);
+    } else {
+	l->uris = files;
+	l->nuris = nfiles;
+    }
+    if (l->nuris == 0) {
+	fprintf(stderr, "wclient: no URIs to request\n");
+	exit(1);
+    }
+    l->keep_alive = keep_alive;
+    l->conns = conns;
+    l->interval = rate > 0 ? conns / rate : 0;
     
-    // Read and display the HTTP Body 
-    n = readline_or_die(fd, buf, MAXBUF);
-    while (n > 0) {
-	printf("%s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+    load_thread_t *threads = calloc(conns, sizeof(load_thread_t));
+    assert(threads != NULL);
+    l->start = client_seconds();
+    l->stop = total > 0 ? 0 : l->start + secs;
+    for (int i = 0; i < conns; i++) {
+	threads[i].load = l;
+	threads[i].id = i;
+	threads[i].seed = i + 1;
+	threads[i].quota = total / conns + (i < total % conns);
+	assert(pthread_create(&threads[i].thread, NULL, load_run, &threads[i]) == 0);
     }
+    for (int i = 0; i < conns; i++)
+	assert(pthread_join(threads[i].thread, NULL) == 0);
+    double elapsed = client_seconds() - l->start;
+    
+    load_report(threads, conns, elapsed);
+    free(threads);
+    free(l);
 }
 
 int main(int argc, char *argv[]) {
-    char *host, *filename;
-    int port;
-    int clientfd;
+    char *host;
+    int port, c;
+    int repeat = 1, reuse = 1, quiet = 0;
+    int load = 0, conns = 1;
+    long total = 0;
+    double secs = 10, rate = 0;
+    char *urifile = NULL;
     
-    if (argc != 4) {
-	fprintf(stderr, "Usage: %s <host> <port> <filename>\n", argv[0]);
+    while ((c = getopt(argc, argv, "n:xqc:d:r:f:")) != -1)
+	switch (c) {
+	case 'n':
+	    repeat = atoi(optarg);
+	    total = atol(optarg);
+	    break;
+	case 'x':
+	    reuse = 0;
+	    break;
+	case 'q':
+	    quiet = 1;
+	    break;
+	case 'c':
+	    conns = atoi(optarg);
+	    load = 1;
+	    break;
+	case 'd':
+	    secs = atof(optarg);
+	    load = 1;
+	    break;
+	case 'r':
+	    rate = atof(optarg);
+	    load = 1;
+	    break;
+	case 'f':
+	    urifile = optarg;
+	    load = 1;
+	    break;
+	default:
+	    argc = 0; // fall into the usage message
+	}
+    
+    if (argc - optind < (load && urifile ? 2 : 3) || conns < 1) {
+	fprintf(stderr, "Usage: %s [-n repeat] [-x] [-q] <host> <port> <filename> [filename ...]\n", argv[0]);
+	fprintf(stderr, "       %s -c conns [-d secs | -n requests] [-r rate] [-f urifile] [-x] "
+		"<host> <port> [filename ...]\n", argv[0]);
 	exit(1);
     }
     
-    host = argv[1];
-    port = atoi(argv[2]);
-    filename = argv[3];
+    host = argv[optind];
+    port = atoi(argv[optind + 1]);
+    char **files = argv + optind + 2;
+    int nfiles = argc - optind - 2;
     
-    /* Open a single connection to the specified host and port */
-    clientfd = open_client_fd_or_die(host, port);
+    if (load) {
+	load_main(host, port, conns, secs, total, rate, urifile, files, nfiles, reuse);
+	exit(0);
+    }
     
-    client_send(clientfd, filename);
-    client_print(clientfd);
+    char hostname[MAXBUF];
+    gethostname_or_die(hostname, MAXBUF);
+    reader_t *r = malloc(sizeof(reader_t));
+    assert(r != NULL);
+    r->fd = -1;
     
-    close_or_die(clientfd);
+    double t1 = client_seconds();
+    int requests = 0, connections = 0, status;
+    for (int i = 0; i < repeat; i++) {
+	for (int j = 0; j < nfiles; j++) {
+	    if (r->fd < 0) {
+		/* Open a connection to the specified host and port */
+		r->fd = open_client_fd_or_die(host, port);
+		r->start = r->end = 0;
+		connections++;
+	    }
+	    if (client_send(r->fd, hostname, files[j], reuse) < 0) {
+		fprintf(stderr, "wclient: connection lost\n");
+		exit(1);
+	    }
+	    requests++;
+	    if (!client_print(r, quiet, &status) || !reuse) {
+		close_or_die(r->fd);
+		r->fd = -1;
+	    }
+	}
+    }
+    if (r->fd >= 0)
+	close_or_die(r->fd);
+    double t2 = client_seconds();
     
+    if (quiet)
+	printf("%d requests over %d connections in %.3f s (%.0f requests/s)\n",
+	       requests, connections, t2 - t1, requests / (t2 - t1));
+    free(r);
     exit(0);
 }
@@ -1,18 +1,43 @@
 #include <stdio.h>
 #include "request.h"
 #include "io_helper.h"
+#include "cache.h"
+#include "cgi_pool.h"
+#include "listener.h"
+#include "stats.h"
 
 char default_root[] = ".";
 
+#define DEFAULT_CACHE_BYTES (32 * 1024 * 1024)
+
+static volatile sig_atomic_t dump_stats = 0;
+
+static void on_sigusr1(int sig) {
+    dump_stats = 1;
+}
+
+//
+// ./wserver [-d <basedir>] [-p <portnum>] [-z <sendfile|mmap>] [-c <cachebytes>]
+//           [-k <idle-ms>] [-w <cgi-workers>] [-W <cgi-timeout-ms>] [-l <listeners>]
+//           [-e <epoll|uring>] [-s <stats-secs>] [-q]
 //
-// ./wserver [-d <basedir>] [-p <portnum>] 
+// -c 0 turns off the static file cache
+// -k is how long a keep-alive connection may sit idle between requests
+// -w keeps that many persistent processes per CGI program (see cgi_pool.h)
+// -l serves from that many SO_REUSEPORT listeners, one per core (see listener.h)
+// -e picks their event loop; uring falls back to epoll where unavailable
+// -s prints request statistics to stderr that often, as does kill -USR1;
+//    they are also served at /__stats (see stats.h)
+// -q turns off the access log on stdout
 // 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
+    long cache_bytes = DEFAULT_CACHE_BYTES;
+    int listeners = 0, stats_secs = 0;
     
-    while ((c = getopt(argc, argv, "d:p:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:z:c:k:w:W:l:e:s:q")) != -1)
 	switch (c) {
 	case 'd':
 	    root_dir = optarg;
@@ -20,22 +45,98 @@ int main(int argc, char *argv[]) {
 	case 'p':
 	    port = atoi(optarg);
 	    break;
+	case 'z':
+	    if (strcmp(optarg, "sendfile") == 0)
+		request_static_mode = STATIC_SENDFILE;
+	    else if (strcmp(optarg, "mmap") == 0)
+		request_static_mode = STATIC_MMAP;
+	    else {
+		fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-z sendfile|mmap] [-c cachebytes] [-k idle-ms] [-w cgi-workers] [-W cgi-timeout-ms] [-l listeners] [-e epoll|uring] [-s stats-secs] [-q]\n");
+		exit(1);
+	    }
+	    break;
+	case 'c':
+	    cache_bytes = atol(optarg);
+	    break;
+	case 'k':
+	    request_idle_timeout = atoi(optarg);
+	    break;
+	case 'w':
+	    cgi_pool_size = atoi(optarg);
+	    break;
+	case 'W':
+	    cgi_pool_timeout = atoi(optarg);
+	    break;
+	case 'l':
+	    listeners = atoi(optarg);
+	    break;
+	case 'e':
+	    if (strcmp(optarg, "epoll") == 0)
+		listener_backend = LISTENER_EPOLL;
+	    else if (strcmp(optarg, "uring") == 0)
+		listener_backend = LISTENER_URING;
+	    else {
+		fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-z sendfile|mmap] [-c cachebytes] [-k idle-ms] [-w cgi-workers] [-W cgi-timeout-ms] [-l listeners] [-e epoll|uring] [-s stats-secs] [-q]\n");
+		exit(1);
+	    }
+	    break;
+	case 's':
+	    stats_secs = atoi(optarg);
+	    break;
+	case 'q':
+	    stats_access_log = 0;
+	    break;
 	default:
-	    fprintf(stderr, "usage: wserver [-d basedir] [-p port]\n");
+	    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-z sendfile|mmap] [-c cachebytes] [-k idle-ms] [-w cgi-workers] [-W cgi-timeout-ms] [-l listeners] [-e epoll|uring] [-s stats-secs] [-q]\n");
 	    exit(1);
 	}
 
     // run out of this directory
     chdir_or_die(root_dir);
 
-    // now, get to work
+    cache_init(cache_bytes);
+    stats_init(stats_secs);
+    
+    // a client that hangs up mid-response shows up as EPIPE on that
+    // connection, rather than killing the server
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (listeners > 0) {
+	// the event loops do all the work; this thread just waits for SIGUSR1,
+	// which is blocked everywhere else
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	listener_start(port, listeners);
+	while (1) {
+	    int sig;
+	    sigwait(&set, &sig);
+	    stats_print(stderr);
+	}
+    }
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    
+    // now, get to work; with one connection served at a time, an idle
+    // kept-alive client would hold up everyone behind it, so each
+    // connection gets one request
+    request_keep_alive = 0;
     int listen_fd = open_listen_fd_or_die(port);
     while (1) {
 	struct sockaddr_in client_addr;
 	int client_len = sizeof(client_addr);
 	int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
-	request_handle(conn_fd);
+	request_serve_connection(conn_fd);
 	close_or_die(conn_fd);
+	if (dump_stats) {
+	    dump_stats = 0;
+	    stats_print(stderr);
+	}
     }
     return 0;
 }
@@ -1,16 +1,23 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-typedef struct node {
-  struct node *pre;
-  struct node *next;
-  char *s;
-} node;
+// The input is mapped rather than read, and its lines go out straight from
+// the mapping, last first: memrchr() finds the newline before each one,
+// and the slices are handed to writev() BATCH at a time.  Beyond the
+// mapping nothing grows with the input, and the pages of the mapping that
+// have been written out are let go as it goes.  Input that cannot be
+// mapped (a pipe, a terminal) is first copied to a temporary file.
+
+#define BATCH IOV_MAX
+#define SPILL_SIZE (1 << 20)
 
 typedef enum bool { false, true } bool;
 
@@ -32,6 +39,69 @@ bool same(char *input, char *output) {
   return stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino;
 }
 
+static void write_all(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w < 0) {
+      fprintf(stderr, "reverse: write failed\n");
+      exit(EXIT_FAILURE);
+    }
+    // skip what went out; a slice may have gone only in part
+    for (; n > 0 && (size_t)w >= iov->iov_len; n--, iov++)
+      w -= iov->iov_len;
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+}
+
+// copies in to an unnamed temporary file, which is returned
+static FILE *spill(FILE *in) {
+  FILE *tmp = tmpfile();
+  char *buf = malloc(SPILL_SIZE);
+  if (tmp == NULL || buf == NULL) {
+    fprintf(stderr, "reverse: cannot make temporary file\n");
+    exit(EXIT_FAILURE);
+  }
+  size_t n;
+  while ((n = fread(buf, 1, SPILL_SIZE, in)) > 0) {
+    if (fwrite(buf, 1, n, tmp) != n)
+      break;
+  }
+  if (n > 0 || fflush(tmp) != 0) {
+    fprintf(stderr, "reverse: cannot make temporary file\n");
+    exit(EXIT_FAILURE);
+  }
+  free(buf);
+  return tmp;
+}
+
+static void reverse(const char *data, size_t size, int out) {
+  static struct iovec iov[BATCH];
+  int n = 0;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t kept = size; // where the mapping still holds its pages up to
+  size_t end = size;  // everything from end on has been queued
+  while (end > 0) {
+    // the line that ends at end, newline and all
+    const char *nl = end > 1 ? memrchr(data, '\n', end - 1) : NULL;
+    size_t start = nl ? (size_t)(nl - data) + 1 : 0;
+    iov[n].iov_base = (char *)data + start;
+    iov[n].iov_len = end - start;
+    end = start;
+    if (++n == BATCH || end == 0) {
+      write_all(out, iov, n);
+      n = 0;
+      size_t from = (end + page - 1) / page * page;
+      if (from < kept) {
+        madvise((char *)data + from, kept - from, MADV_DONTNEED);
+        kept = from;
+      }
+    }
+  }
+}
+
 int main(int argc, char *argv[]) {
   FILE *in = stdin;
   FILE *out = stdout;
@@ -59,28 +129,25 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  node *head = calloc(1, sizeof(node));
-  node *now = head;
-
-  char *line = NULL;
-  size_t bufsize = 0;
-  ssize_t nread = 0;
-
-  while ((nread = getline(&line, &bufsize, in)) != -1) {
-    now->next = calloc(1, sizeof(node));
-    now->next->pre = now;
-    now = now->next;
-    now->s = strdup(line);
-    if (now->s == NULL) {
-      fprintf(stderr, "malloc failed\n");
+  struct stat sb;
+  if (fstat(fileno(in), &sb) == -1 || !S_ISREG(sb.st_mode) ||
+      sb.st_size == 0) {
+    // nothing to map in place (or a file that only says it is empty)
+    in = spill(in);
+    if (fstat(fileno(in), &sb) == -1) {
+      fprintf(stderr, "reverse: cannot make temporary file\n");
       exit(EXIT_FAILURE);
     }
   }
+  if (sb.st_size == 0)
+    return 0;
 
-  while (now != head) {
-    fprintf(out, "%s", now->s);
-    now = now->pre;
+  char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "reverse: cannot map input\n");
+    exit(EXIT_FAILURE);
   }
+  reverse(data, sb.st_size, fileno(out));
 
   return 0;
-}
\ No newline at end of file
+}
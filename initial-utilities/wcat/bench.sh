@@ -0,0 +1,78 @@
+#! /bin/bash
+
+# wcat against the plain read()/write() loop it replaced, for each kind of
+# stdout it treats differently:
+#   ./bench.sh [megabytes]
+# Reports GB/s copying a generated file to a regular file, a pipe, a
+# socket and /dev/null, and checks that what arrives is the input
+# (only its length, for the socket).
+
+MB=${1:-1024}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+gcc -Wall -Werror -O -o $DIR/wcat wcat.c || exit 1
+# the loop as it was
+cat > $DIR/old.c <<'C'
+#include <fcntl.h>
+#include <unistd.h>
+int main(int argc, char *argv[]) {
+  char b[1024];
+  for (int i = 1; i < argc; i++) {
+    int fd = open(argv[i], O_RDONLY), n;
+    while ((n = read(fd, b, sizeof(b))) > 0)
+      write(1, b, n);
+  }
+}
+C
+gcc -O -o $DIR/old $DIR/old.c || exit 1
+
+head -c $((MB << 20)) /dev/urandom > $DIR/input
+SUM=$(cksum < $DIR/input)
+
+now() { date +%s%N; }
+
+# reads a socket to the end, printing how many bytes came
+cat > $DIR/sock.py <<'PY'
+import socket, subprocess, sys, zlib
+a, b = socket.socketpair()
+p = subprocess.Popen(sys.argv[1:], stdout=a)
+a.close()
+buf, n = bytearray(1 << 20), 0
+while True:
+    k = b.recv_into(buf)
+    if k == 0:
+        break
+    n += k
+p.wait()
+print(n)
+PY
+
+report() { # output, tool, start, end
+    awk -v out=$1 -v tool=$2 -v ns=$(($4 - $3)) -v mb=$MB \
+        'BEGIN { printf "%-9s %-4s %7.3f s %6.2f GB/s\n", out, tool, ns / 1e9, mb / 1024 / (ns / 1e9) }'
+}
+
+for out in file pipe socket devnull; do
+    for tool in wcat old; do
+        rm -f $DIR/out
+        start=$(now)
+        case $out in
+        file) $DIR/$tool $DIR/input > $DIR/out ;;
+        pipe) got=$($DIR/$tool $DIR/input | cksum) ;;
+        socket) got=$(python3 $DIR/sock.py $DIR/$tool $DIR/input) ;;
+        devnull) $DIR/$tool $DIR/input > /dev/null ;;
+        esac
+        end=$(now)
+        report $out $tool $start $end
+        case $out in
+        file) got=$(cksum < $DIR/out) ;;
+        socket) [ "$got" = $((MB << 20)) ] && got=$SUM ;;
+        devnull) got=$SUM ;;
+        esac
+        if [ "$got" != "$SUM" ]; then
+            echo "$out: $tool copied the wrong bytes"
+            exit 1
+        fi
+    done
+done
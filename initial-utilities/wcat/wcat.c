@@ -1,26 +1,111 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+// Files are copied to stdout inside the kernel where it can be done,
+// without passing through a buffer here: with copy_file_range() when
+// stdout is a regular file, sendfile() when it is a socket, and splice()
+// when it is a pipe.  Each of these refuses some combinations (files on
+// different file systems, an O_APPEND stdout, an input that is itself a
+// pipe), and the copy then goes on with the next method that might work,
+// down to read() and write() through a large page-aligned buffer.
+
+#define CHUNK (1 << 30)    // most asked of the kernel in one call
+#define BUF_SIZE (1 << 17) // for read() and write()
+
+enum { COPY_RANGE, SENDFILE, SPLICE, READ_WRITE };
+
+// what to try when a method is refused
+static const int fallback[] = {
+    [COPY_RANGE] = SENDFILE, [SENDFILE] = READ_WRITE, [SPLICE] = SENDFILE};
+
+static char *buffer = NULL;
+
+// Moves what is left of in to stdout one way; returns 0 at the end of
+// in, -1 if that way cannot be used from where it left off, or -2 if the
+// copy failed (errno says why).  read() and write() always can be used.
+static int copy(int in, int method) {
+  int started = 0;
+  while (1) {
+    ssize_t n;
+    switch (method) {
+    case COPY_RANGE:
+      n = copy_file_range(in, NULL, STDOUT_FILENO, NULL, CHUNK, 0);
+      break;
+    case SENDFILE:
+      n = sendfile(STDOUT_FILENO, in, NULL, CHUNK);
+      break;
+    case SPLICE:
+      n = splice(in, NULL, STDOUT_FILENO, NULL, CHUNK, SPLICE_F_MORE);
+      break;
+    default:
+      if (buffer == NULL && (errno = posix_memalign((void **)&buffer,
+                                                    sysconf(_SC_PAGESIZE),
+                                                    BUF_SIZE)) != 0)
+        return -2;
+      n = read(in, buffer, BUF_SIZE);
+      for (ssize_t done = 0, w; n > 0 && done < n; done += w)
+        if ((w = write(STDOUT_FILENO, buffer + done, n - done)) < 0) {
+          if (errno == EINTR)
+            w = 0;
+          else
+            return -2;
+        }
+      break;
+    }
+    if (n == 0)
+      return 0;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      // once something has gone out this way, going on another way could
+      // send it twice; only refusals up front mean "try another way"
+      return started || method == READ_WRITE ? -2 : -1;
+    }
+    started = 1;
+  }
+}
+
+// where to start, given what stdout is
+static int first_method() {
+  struct stat sb;
+  if (fstat(STDOUT_FILENO, &sb) < 0)
+    return READ_WRITE;
+  if (S_ISREG(sb.st_mode))
+    return COPY_RANGE;
+  if (S_ISSOCK(sb.st_mode))
+    return SENDFILE;
+  if (S_ISFIFO(sb.st_mode))
+    return SPLICE;
+  return READ_WRITE;
+}
+
 int main(int argc, char *argv[]) {
 
   if (argc == 1) {
     return 0;
   }
 
-  char buffer[1024];
-  ssize_t size;
-
+  int start = first_method();
   for (int i = 1; i < argc; i++) {
     int fd = open(argv[i], O_RDONLY);
     if (fd == -1) {
       printf("wcat: cannot open file\n");
       return 1;
     }
-    while ((size = read(fd, buffer, 1024)) > 0) {
-      write(STDOUT_FILENO, buffer, size);
+    int rc, method = start;
+    while ((rc = copy(fd, method)) == -1)
+      method = fallback[method];
+    if (rc < 0) {
+      perror("wcat");
+      return 1;
     }
+    close(fd);
   }
 }
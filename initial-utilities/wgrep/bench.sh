@@ -0,0 +1,52 @@
+#! /bin/bash
+
+# wgrep against GNU grep (fixed strings, C locale) on a generated file:
+#   ./bench.sh [megabytes]
+# Checks that the two print the same lines, then reports the time of each,
+# for a needle that is rare, one that is common, and one single byte, and
+# for 300 needles at once (-f).
+
+MB=${1:-512}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+gcc -Wall -Werror -O -o $DIR/wgrep wgrep.c || exit 1
+
+python3 - $DIR/input $MB <<'EOF'
+import random, sys
+random.seed(1)
+words = [b"GET", b"POST", b"/index.html", b"/api/v1/users", b"200", b"404",
+         b"Mozilla/5.0", b"curl/7.81", b"timeout", b"upstream", b"ok"]
+block = b"".join(b" ".join(random.choice(words) for _ in range(random.randrange(4, 16))) + b"\n"
+                 for _ in range(20000))
+block = block.replace(b"timeout upstream", b"timeout upstream XYZZY", 1)
+with open(sys.argv[1], "wb") as f:
+    for _ in range(int(sys.argv[2]) * (1 << 20) // len(block)):
+        f.write(block)
+# made-up host names, one of which is in the input
+with open(sys.argv[1] + ".patterns", "wb") as f:
+    for i in range(299):
+        f.write(b"host-%04d.example\n" % random.randrange(10000))
+    f.write(b"XYZZY\n")
+EOF
+
+now() { date +%s%N; }
+cat $DIR/input > /dev/null # warm the page cache
+
+for needle in XYZZY upstream Z -f; do
+    for tool in wgrep grep; do
+        cmd=$DIR/wgrep
+        [ $tool = grep ] && cmd="grep -F"
+        args=("$needle")
+        [ $needle = -f ] && args=(-f $DIR/input.patterns)
+        start=$(now)
+        LC_ALL=C $cmd "${args[@]}" $DIR/input > $DIR/out.$tool
+        end=$(now)
+        awk -v needle=$needle -v tool=$tool -v ns=$((end - start)) \
+            'BEGIN { printf "%-9s %-7s %8.3f s\n", needle, tool, ns / 1e9 }'
+    done
+    if ! cmp -s $DIR/out.wgrep $DIR/out.grep; then
+        echo "$needle: wgrep and grep differ"
+        exit 1
+    fi
+done
@@ -1,81 +1,525 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// Files are searched whole for the needle, not line by line: a line is
+// only looked at once the needle has been found in it, and then just far
+// enough to find where it starts and ends.  Regular files are mapped;
+// anything else (a pipe on stdin) is read in large blocks, and only the
+// partial line at the end of a block is carried over to the next.
+//
+// With more than one CPU, regular files are searched in parallel: the
+// main thread cuts them into chunks of about CHUNK bytes, ending at a
+// newline, and a pool of threads searches the chunks, each into its own
+// output buffer.  The main thread writes the buffers out in file and line
+// order, and stays no more than WINDOW_PER_THREAD chunks per thread ahead
+// of the writing, so only that many files are mapped at once.
+//
+// With -f, the needles are the lines of a file, and a line is printed if
+// it holds any of them.  They are all looked for in one pass, by an
+// Aho-Corasick automaton.
+
+#define READ_SIZE (1 << 20)
+#define OUT_SIZE (1 << 16)
+#define CHUNK (1 << 22)
+#define WINDOW_PER_THREAD 4
+
 const char *needle;
+size_t needle_len;
+
+// Where matched lines go: collected in a buffer, and written out to stdout
+// whenever it fills up or, for a chunk searched in parallel, kept whole
+// until its turn comes
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  int keep;
+} sink_t;
+
+static void flush(sink_t *out) {
+  if (out->len > 0 && write(STDOUT_FILENO, out->buf, out->len) < 0)
+    exit(1);
+  out->len = 0;
+}
 
-int findNewLine(int start, int size, char *buffer) {
-  for (int j = start; j < size; j++) {
-    if (buffer[j] == '\n') {
-      buffer[j] = 0;
-      return j;
+static void emit_line(sink_t *out, const char *p, size_t len) {
+  if (out->len + len + 1 > out->cap) {
+    if (out->keep) {
+      while (out->len + len + 1 > out->cap)
+        out->cap = out->cap ? out->cap * 2 : OUT_SIZE;
+      if ((out->buf = realloc(out->buf, out->cap)) == NULL) {
+        perror("wgrep");
+        exit(1);
+      }
+    } else {
+      flush(out);
+      if (len + 1 > out->cap) {
+        if (write(STDOUT_FILENO, p, len) < 0 ||
+            write(STDOUT_FILENO, "\n", 1) < 0)
+          exit(1);
+        return;
+      }
     }
   }
-  return -1;
+  memcpy(out->buf + out->len, p, len);
+  out->buf[out->len + len] = '\n';
+  out->len += len + 1;
+}
+
+// Searchers for needles of two bytes or more: each returns the first
+// occurrence in h[0, n), or NULL.  The vector ones check 32 or 16
+// positions at once for the needle's first and last bytes, and compare
+// the rest only where both are right, which in most text is rarely.  The
+// scalar one is glibc's memmem(), a Two-Way search.
+
+static const char *search_scalar(const char *h, size_t n) {
+  return memmem(h, n, needle, needle_len);
 }
 
-void processFile(int fd) {
-  int len = 2048;
-  char *buffer = (char *)malloc(len);
+#ifdef HAVE_X86
+__attribute__((target("sse2"))) static const char *search_sse2(const char *h,
+                                                               size_t n) {
+  size_t k = needle_len, i = 0;
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[k - 1]);
+  for (; i + k - 1 + 16 <= n; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(h + i + k - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+    for (; mask != 0; mask &= mask - 1) {
+      const char *m = h + i + __builtin_ctz(mask);
+      if (memcmp(m + 1, needle + 1, k - 2) == 0)
+        return m;
+    }
+  }
+  return i < n ? search_scalar(h + i, n - i) : NULL;
+}
 
-  ssize_t size = read(fd, buffer, len);
-  if (size < len && buffer[size - 1] != '\n') {
-    buffer[size] = '\n';
+__attribute__((target("avx2"))) static const char *search_avx2(const char *h,
+                                                               size_t n) {
+  size_t k = needle_len, i = 0;
+  __m256i first = _mm256_set1_epi8(needle[0]);
+  __m256i last = _mm256_set1_epi8(needle[k - 1]);
+  for (; i + k - 1 + 32 <= n; i += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(h + i + k - 1));
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+    for (; mask != 0; mask &= mask - 1) {
+      const char *m = h + i + __builtin_ctz(mask);
+      if (memcmp(m + 1, needle + 1, k - 2) == 0)
+        return m;
+    }
   }
+  return i < n ? search_sse2(h + i, n - i) : NULL;
+}
+#endif
 
-  int pos; // position of \n
-  while (size > 0) {
+// the best searcher this CPU can run
+static const char *(*search_long)(const char *, size_t) = search_scalar;
 
-    int start = 0;
-    while ((pos = findNewLine(start, size, buffer)) == -1) {
-      start = size;
-      // 防止 len 无限增长
-      if (size == len) {
-        len <<= 1;
-        buffer = (char *)realloc(buffer, len);
-      }
-      size = size + read(fd, buffer + size, len - size);
-      if (size < len && buffer[size - 1] != '\n') {
-        buffer[size] = '\n';
-      }
+// The automaton for -f, as a table of transitions for every state and
+// byte (a DFA: failure links are folded in when it is built), so each
+// byte of input costs one lookup.  States are numbered in multiples of
+// 256, so a state plus a byte is its row in ac_next directly.
+static int *ac_next = NULL;
+static char *ac_match; // by state / 256: the input so far ends in a needle
+
+// Bit (a | b << 8) is set if a needle could start with bytes a, b (or is
+// just a).  Where there is no match under way, input is skipped until
+// it gets to such a pair, at much less than a step of the automaton per
+// byte.
+static unsigned char ac_start[65536 / 8];
+
+static int ac_starts(const char *p) {
+  unsigned pair = (unsigned char)p[0] | (unsigned char)p[1] << 8;
+  return ac_start[pair / 8] & (1 << pair % 8);
+}
+
+// builds the automaton for n needles, all non-empty
+static void ac_build(char **pats, size_t *lens, int n) {
+  size_t cap = 1;
+  for (int i = 0; i < n; i++)
+    cap += lens[i];
+  ac_next = malloc(cap * 256 * sizeof(int));
+  ac_match = calloc(cap, 1);
+  int *fail = malloc(cap * sizeof(int)), *queue = malloc(cap * sizeof(int));
+  if (ac_next == NULL || ac_match == NULL || fail == NULL || queue == NULL) {
+    perror("wgrep");
+    exit(1);
+  }
+  memset(ac_next, -1, cap * 256 * sizeof(int));
+
+  // the trie of the needles
+  int states = 1;
+  for (int i = 0; i < n; i++) {
+    int s = 0;
+    for (size_t j = 0; j < lens[i]; j++) {
+      int *t = &ac_next[s + (unsigned char)pats[i][j]];
+      if (*t < 0)
+        *t = 256 * states++;
+      s = *t;
+    }
+    ac_match[s / 256] = 1;
+
+    // the pairs this needle could start with
+    unsigned a = (unsigned char)pats[i][0];
+    for (unsigned b = 0; b < 256; b++) {
+      if (lens[i] > 1 && b != (unsigned char)pats[i][1])
+        continue;
+      ac_start[(a | b << 8) / 8] |= 1 << (a | b << 8) % 8;
     }
+  }
 
-    int lastPos = -1;
-    do {
-      if (strstr(buffer + lastPos + 1, needle) != NULL) {
-        write(STDOUT_FILENO, buffer + lastPos + 1, pos - lastPos - 1);
-        write(STDOUT_FILENO, "\n", 1);
+  // breadth first, so a state's failure state (which is shallower) is
+  // complete by the time the state is reached: a missing transition goes
+  // where the failure state's does, and a state matches if its failure
+  // state does
+  int head = 0, tail = 0;
+  for (int c = 0; c < 256; c++) {
+    if (ac_next[c] < 0) {
+      ac_next[c] = 0;
+    } else {
+      fail[ac_next[c] / 256] = 0;
+      queue[tail++] = ac_next[c];
+    }
+  }
+  while (head < tail) {
+    int s = queue[head++], f = fail[s / 256];
+    ac_match[s / 256] |= ac_match[f / 256];
+    for (int c = 0; c < 256; c++) {
+      int t = ac_next[s + c];
+      if (t < 0) {
+        ac_next[s + c] = ac_next[f + c];
+      } else {
+        fail[t / 256] = ac_next[f + c];
+        queue[tail++] = t;
       }
-      lastPos = pos;
-    } while ((pos = findNewLine(lastPos, size, buffer)) != -1);
+    }
+  }
+  free(fail);
+  free(queue);
+}
+
+// where the first match ends (its last byte), or NULL
+static const char *search_ac(const char *h, size_t n) {
+  int s = 0;
+  for (size_t i = 0; i < n; i++) {
+    // The state only remembers the longest end of the input that begins
+    // a needle, so from the start state, bytes no needle can start at
+    // leave it where it was
+    if (s == 0)
+      while (i + 1 < n && !ac_starts(h + i))
+        i++;
+    s = ac_next[s + (unsigned char)h[i]];
+    if (ac_match[s / 256])
+      return h + i;
+  }
+  return NULL;
+}
 
-    size = size - lastPos - 1;
-    for (int i = 0; i < size; i++) {
-      buffer[i] = buffer[lastPos + i + 1];
+// Finds a needle in h[0, n): returns a pointer into the first match, or
+// NULL
+static const char *search(const char *h, size_t n) {
+  if (ac_next != NULL)
+    return search_ac(h, n);
+  if (needle_len == 0)
+    return h;
+  if (needle_len == 1)
+    return memchr(h, needle[0], n);
+  return search_long(h, n);
+}
+
+// a line never holds a newline, so a needle with one in it never matches
+static int never;
+
+// Prints the lines of [p, end) that hold the needle; the last one need
+// not end in a newline
+static void grep_lines(sink_t *out, const char *p, const char *end) {
+  if (never)
+    return;
+  while (p < end) {
+    const char *m = search(p, end - p);
+    if (m == NULL)
+      return;
+    const char *start = memrchr(p, '\n', m - p);
+    start = start ? start + 1 : p;
+    const char *stop = memchr(m, '\n', end - m);
+    stop = stop ? stop : end;
+    emit_line(out, start, stop - start);
+    p = stop + 1;
+  }
+}
+
+// maps a regular file; returns NULL if it is not one, or is empty
+static char *map_file(int fd, size_t *size) {
+  struct stat sb;
+  if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+    return NULL;
+  char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+  madvise(data, sb.st_size, MADV_SEQUENTIAL);
+  *size = sb.st_size;
+  return data;
+}
+
+void processFile(int fd, sink_t *out) {
+  struct stat sb;
+  size_t mapped;
+  char *data = map_file(fd, &mapped);
+  if (data != NULL) {
+    grep_lines(out, data, data + mapped);
+    munmap(data, mapped);
+    return;
+  }
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size == 0)
+    return;
+
+  size_t len = READ_SIZE, size = 0;
+  char *buffer = malloc(len);
+  ssize_t rc;
+  while (buffer != NULL && (rc = read(fd, buffer + size, len - size)) > 0) {
+    size += rc;
+    // search the whole lines, and keep the partial one for the next read
+    char *nl = memrchr(buffer, '\n', size);
+    if (nl == NULL) {
+      // one line fills the buffer; make room for more of it
+      if (size == len)
+        buffer = realloc(buffer, len <<= 1);
+      continue;
     }
+    grep_lines(out, buffer, nl + 1);
+    size -= nl + 1 - buffer;
+    memmove(buffer, nl + 1, size);
+  }
+  if (buffer == NULL) {
+    perror("wgrep");
+    exit(1);
   }
+  grep_lines(out, buffer, buffer + size);
   free(buffer);
 }
 
+// a chunk of a mapped file, and what searching it printed
+typedef struct {
+  const char *p, *end;
+  void *unmap; // if the file's last chunk, its mapping
+  size_t unmap_len;
+  int done;
+  sink_t out;
+} job_t;
+
+static job_t *jobs;
+static int window;
+static long queued = 0, taken = 0, written = 0;
+static int finished = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static void *worker(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (taken == queued && !finished)
+      pthread_cond_wait(&job_queued, &lock);
+    if (taken == queued)
+      break;
+    job_t *j = &jobs[taken++ % window];
+    pthread_mutex_unlock(&lock);
+
+    grep_lines(&j->out, j->p, j->end);
+
+    pthread_mutex_lock(&lock);
+    j->done = 1;
+    pthread_cond_broadcast(&job_done);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// writes out the oldest job once it is done, and frees its slot
+static void write_next() {
+  job_t *j = &jobs[written % window];
+  pthread_mutex_lock(&lock);
+  while (!j->done)
+    pthread_cond_wait(&job_done, &lock);
+  pthread_mutex_unlock(&lock);
+  flush(&j->out);
+  if (j->unmap != NULL)
+    munmap(j->unmap, j->unmap_len);
+  written++;
+}
+
+static void add_job(const char *p, const char *end, void *unmap, size_t len) {
+  if (queued - written == window)
+    write_next();
+  job_t *j = &jobs[queued % window];
+  j->p = p;
+  j->end = end;
+  j->unmap = unmap;
+  j->unmap_len = len;
+  j->done = 0;
+  j->out.len = 0;
+  pthread_mutex_lock(&lock);
+  queued++;
+  pthread_cond_signal(&job_queued);
+  pthread_mutex_unlock(&lock);
+}
+
+// Searches the files with nthreads threads; returns -1 if one of them
+// could not be opened, having printed what came before it
+static int processFiles(char **files, int nfiles, int nthreads, sink_t *out) {
+  window = nthreads * WINDOW_PER_THREAD;
+  if ((jobs = calloc(window, sizeof(job_t))) == NULL) {
+    perror("wgrep");
+    exit(1);
+  }
+  for (int i = 0; i < window; i++)
+    jobs[i].out.keep = 1;
+  pthread_t threads[nthreads];
+  for (int i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, NULL);
+
+  int status = 0;
+  for (int i = 0; i < nfiles; i++) {
+    int fd = open(files[i], O_RDONLY);
+    if (fd == -1) {
+      status = -1;
+      break;
+    }
+    size_t size;
+    char *data = map_file(fd, &size);
+    if (data == NULL) {
+      // not a regular file: catch up, then read it here
+      while (written < queued)
+        write_next();
+      processFile(fd, out);
+      flush(out);
+      close(fd);
+      continue;
+    }
+    close(fd);
+    for (char *p = data, *end = data + size; p < end;) {
+      char *stop = p + CHUNK < end ? memchr(p + CHUNK, '\n', end - p - CHUNK) : NULL;
+      stop = stop ? stop + 1 : end;
+      add_job(p, stop, stop == end ? data : NULL, size);
+      p = stop;
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  finished = 1;
+  pthread_cond_broadcast(&job_queued);
+  pthread_mutex_unlock(&lock);
+  while (written < queued)
+    write_next();
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  return status;
+}
+
+// -f: reads the needles, one per line.  One of them is searched for as
+// usual, and so is an empty one, which every line holds; the automaton is
+// only needed for two or more.
+static int read_patterns(const char *name) {
+  FILE *f = fopen(name, "r");
+  if (f == NULL)
+    return -1;
+  char **pats = NULL, *line = NULL;
+  size_t *lens = NULL, cap = 0;
+  int n = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, f)) >= 0) {
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    pats = realloc(pats, (n + 1) * sizeof(char *));
+    lens = realloc(lens, (n + 1) * sizeof(size_t));
+    if (pats == NULL || lens == NULL || (pats[n] = strdup(line)) == NULL) {
+      perror("wgrep");
+      exit(1);
+    }
+    lens[n++] = len;
+    if (len == 0) {
+      needle = "";
+      needle_len = 0;
+      n = 0; // every line matches anyway
+      break;
+    }
+  }
+  free(line);
+  fclose(f);
+  if (n == 1) {
+    needle = pats[0];
+    needle_len = lens[0];
+  } else if (n > 1) {
+    ac_build(pats, lens, n);
+  } else if (needle == NULL) {
+    never = 1; // no needles at all
+  }
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
-  needle = argv[1];
   if (argc < 2) {
     printf("wgrep: searchterm [file ...]\n");
     return 1;
-  } else if (argc == 2) {
-    processFile(STDIN_FILENO);
+  }
+  int first = 2;
+  if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+    first = 3;
+    if (read_patterns(argv[2]) < 0) {
+      printf("wgrep: cannot open file\n");
+      return 1;
+    }
+  } else {
+    needle = argv[1];
+    needle_len = strlen(needle);
+    never = memchr(needle, '\n', needle_len) != NULL;
+  }
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    search_long = search_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    search_long = search_sse2;
+#endif
+  static char buf[OUT_SIZE];
+  sink_t out = {buf, 0, OUT_SIZE, 0};
+  int nthreads = get_nprocs();
+  if (argc == first) {
+    processFile(STDIN_FILENO, &out);
+  } else if (nthreads > 1) {
+    if (processFiles(argv + first, argc - first, nthreads, &out) < 0) {
+      printf("wgrep: cannot open file\n");
+      return 1;
+    }
   } else {
-    for (int i = 2; i < argc; i++) {
+    for (int i = first; i < argc; i++) {
       int fd = open(argv[i], O_RDONLY);
       if (fd == -1) {
+        flush(&out);
         printf("wgrep: cannot open file\n");
         return 1;
       }
-      processFile(fd);
+      processFile(fd, &out);
+      close(fd);
     }
   }
+  flush(&out);
+  return 0;
 }
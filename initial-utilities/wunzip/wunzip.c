@@ -1,25 +1,430 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
 
-int main(int argc, char *argv[]) {
-  if (argc == 1) {
-    printf("wunzip: file1 [file2 ...]\n");
-    return 1;
-  }
+// The compressed files are mapped (or, if they are pipes and the like,
+// read into memory), and their records, taken in order across all of
+// them, cut into blocks of BLOCK records.  Decoding is then done in two
+// parallel passes:
+//
+// 1. each block's output length is added up; a prefix sum over those then
+//    says where in the output every block starts;
+// 2. the output is cut into SEGMENT-byte segments, and each thread fills
+//    the ones it takes with one memset() per run, finding the first run
+//    of a segment by binary search over the block starts.
+//
+// If stdout is a regular file, threads pwrite() their segments straight to
+// where they go.  Otherwise (a pipe, say) they go into a ring of
+// SLOTS_PER_THREAD buffers per thread, which the main thread writes out in
+// order; the ring keeps the threads from getting too far ahead of it.
+//
+// A file may also be an indexed container, as written by wzip -i: its
+// index gives every block's place in the output, so pass 1 is skipped
+// for it, and with -r first-last only the blocks holding those bytes of
+// the output are decoded.
+
+#define RECORD 5 // 4-byte count, then the byte
+#define BLOCK 4096
+#define SEGMENT (1 << 20)
+#define SLOTS_PER_THREAD 4
+
+// the container's layout; see wzip.c
+#define INDEX_MAGIC "WZIX"
+#define INDEX_VERSION 1
+#define INDEX_HEADER 8
+#define INDEX_FOOTER 20
+
+typedef struct {
+  const unsigned char *rec; // nrec records, all from one file
+  size_t nrec;
+  int sized;      // len is known (from an index)
+  uint64_t len;   // output length
+  uint64_t start; // where the block's output begins
+} block_t;
+
+typedef struct {
+  long seg; // which segment the slot holds
+  int done;
+  size_t len;
+  char *buf;
+} slot_t;
+
+static block_t *blocks;
+static long nblocks;
+static uint64_t total; // output length
+static uint64_t from, to; // the part of it to write out
+static long nsegs;
+
+static int nthreads;
+static long next_job = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int direct; // stdout is a regular file; pwrite() to it
+static off_t base; // stdout's offset when we started
+static slot_t *slots;
+static int nslots;
+static long written = 0; // segments the writer is finished with
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t slot_done = PTHREAD_COND_INITIALIZER;
+
+static uint64_t run_length(const unsigned char *r) {
   int count;
-  char c;
-  for (int i = 1; i < argc; i++) {
-    FILE *f = fopen(argv[i], "r");
-    if (f == NULL) {
-      return 1;
-    }
+  memcpy(&count, r, 4);
+  return count > 0 ? count : 0; // wunzip wrote nothing for count <= 0
+}
+
+static long take_job(long njobs) {
+  pthread_mutex_lock(&lock);
+  long i = next_job < njobs ? next_job++ : -1;
+  pthread_mutex_unlock(&lock);
+  return i;
+}
 
-    while (fread(&count, sizeof(int), 1, f) > 0) {
-      fread(&c, sizeof(char), 1, f);
-      for(int j = 0; j < count; j++) {
-        putchar(c);
+static void fail(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+// pass 1: the output length of each block that has no index
+static void *sum_blocks(void *arg) {
+  long b;
+  while ((b = take_job(nblocks)) >= 0) {
+    if (blocks[b].sized)
+      continue;
+    uint64_t n = 0;
+    for (size_t i = 0; i < blocks[b].nrec; i++)
+      n += run_length(blocks[b].rec + i * RECORD);
+    blocks[b].len = n;
+  }
+  return NULL;
+}
+
+// decodes output bytes [from, from + len) into buf
+static void fill(char *buf, uint64_t from, size_t len) {
+  if (nblocks == 0) {
+    memset(buf, 0, len);
+    return;
+  }
+  // the last block starting at or before from
+  long lo = 0, hi = nblocks - 1;
+  while (lo < hi) {
+    long mid = (lo + hi + 1) / 2;
+    if (blocks[mid].start <= from)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  size_t n = 0;
+  for (long b = lo; b < nblocks && n < len; b++) {
+    // a damaged container's runs might not add up to what its index says;
+    // then each block at least still lands where the index puts it
+    uint64_t pos = blocks[b].start;
+    for (size_t i = 0; i < blocks[b].nrec && n < len; i++) {
+      const unsigned char *r = blocks[b].rec + i * RECORD;
+      uint64_t end = pos + run_length(r);
+      if (end > from + n) {
+        size_t k = end - (from + n) < len - n ? end - (from + n) : len - n;
+        memset(buf + n, r[4], k);
+        n += k;
       }
+      pos = end;
+    }
+  }
+  memset(buf + n, 0, len - n);
+}
+
+static void write_all(int fd, const char *p, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t rc = direct ? pwrite(fd, p, len, off) : write(fd, p, len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      fail("wunzip");
+    p += rc;
+    len -= rc;
+    off += rc;
+  }
+}
+
+// pass 2
+static void *fill_segments(void *arg) {
+  char *own = NULL;
+  long s;
+  while ((s = take_job(nsegs)) >= 0) {
+    uint64_t at = (uint64_t)s * SEGMENT;
+    size_t len = to - from - at < SEGMENT ? to - from - at : SEGMENT;
+    if (direct) {
+      if (own == NULL && (own = malloc(SEGMENT)) == NULL)
+        fail("wunzip");
+      fill(own, from + at, len);
+      write_all(STDOUT_FILENO, own, len, base + at);
+      continue;
+    }
+
+    // segment s goes in the slot that segment s - nslots used
+    pthread_mutex_lock(&lock);
+    while (s >= written + nslots)
+      pthread_cond_wait(&slot_free, &lock);
+    pthread_mutex_unlock(&lock);
+    slot_t *slot = &slots[s % nslots];
+    if (slot->buf == NULL && (slot->buf = malloc(SEGMENT)) == NULL)
+      fail("wunzip");
+    fill(slot->buf, from + at, len);
+
+    pthread_mutex_lock(&lock);
+    slot->seg = s;
+    slot->len = len;
+    slot->done = 1;
+    pthread_cond_broadcast(&slot_done);
+    pthread_mutex_unlock(&lock);
+  }
+  free(own);
+  return NULL;
+}
+
+static pthread_t *threads;
+
+static void start_threads(void *(*fn)(void *)) {
+  next_job = 0;
+  for (int i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, fn, NULL);
+}
+
+static void join_threads() {
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+}
+
+static block_t *add_block(const unsigned char *rec, size_t nrec, size_t *cap) {
+  if (nblocks == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    if ((blocks = realloc(blocks, *cap * sizeof(block_t))) == NULL)
+      fail("wunzip");
+  }
+  block_t *b = &blocks[nblocks++];
+  b->rec = rec;
+  b->nrec = nrec;
+  b->sized = 0;
+  return b;
+}
+
+// the i'th index entry: offsets in the output and in the container
+static void index_entry(const unsigned char *index, uint64_t i, uint64_t *out,
+                        uint64_t *in) {
+  memcpy(out, index + i * 16, 8);
+  memcpy(in, index + i * 16 + 8, 8);
+}
+
+// If data is an indexed container, adds its blocks and returns 1.  Anything
+// that does not hold together as one is taken for a bare stream of records.
+static int map_indexed(const unsigned char *data, size_t size, size_t *cap) {
+  uint32_t version;
+  uint64_t n, len;
+  if (size < INDEX_HEADER + INDEX_FOOTER || memcmp(data, INDEX_MAGIC, 4) != 0 ||
+      memcmp(data + size - 4, INDEX_MAGIC, 4) != 0)
+    return 0;
+  memcpy(&version, data + 4, 4);
+  memcpy(&n, data + size - INDEX_FOOTER, 8);
+  memcpy(&len, data + size - INDEX_FOOTER + 8, 8);
+  if (version != INDEX_VERSION ||
+      n > (size - INDEX_HEADER - INDEX_FOOTER) / 16)
+    return 0;
+  const unsigned char *index = data + size - INDEX_FOOTER - n * 16;
+  uint64_t records_end = index - data;
+
+  // check it all before adding any of it
+  uint64_t out = 0, in = INDEX_HEADER;
+  for (uint64_t i = 0; i <= n; i++) {
+    uint64_t next_out = len, next_in = records_end;
+    if (i < n)
+      index_entry(index, i, &next_out, &next_in);
+    if (next_out < out || next_in < in || (next_in - in) % RECORD != 0 ||
+        (i == 0 && next_in != INDEX_HEADER && n > 0))
+      return 0;
+    out = next_out;
+    in = next_in;
+  }
+  if (n == 0 && (len != 0 || records_end != INDEX_HEADER))
+    return 0;
+
+  for (uint64_t i = 0; i < n; i++) {
+    uint64_t next_out = len, next_in = records_end;
+    index_entry(index, i, &out, &in);
+    if (i + 1 < n)
+      index_entry(index, i + 1, &next_out, &next_in);
+    block_t *b = add_block(data + in, (next_in - in) / RECORD, cap);
+    b->sized = 1;
+    b->len = next_out - out;
+  }
+  return 1;
+}
+
+// reads what cannot be mapped (a pipe, a terminal) into memory instead
+static unsigned char *read_all(int fd, size_t *size) {
+  size_t cap = BLOCK * RECORD, n = 0;
+  unsigned char *buf = malloc(cap);
+  while (buf != NULL) {
+    if (n == cap) {
+      unsigned char *bigger = realloc(buf, cap *= 2);
+      if (bigger == NULL)
+        break;
+      buf = bigger;
+    }
+    ssize_t rc = read(fd, buf + n, cap - n);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      break;
+    if (rc == 0) {
+      *size = n;
+      return buf;
     }
+    n += rc;
   }
+  free(buf);
+  return NULL;
+}
 
+// adds the blocks of one file; returns -1 if it cannot be read
+static int map_file(const char *name, size_t *cap, unsigned char *last) {
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat sb;
+  const unsigned char *data;
+  size_t size;
+  if (fstat(fd, &sb) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (S_ISREG(sb.st_mode)) {
+    size = sb.st_size;
+    data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (data == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+  } else if ((data = read_all(fd, &size)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  if (size == 0)
+    return 0;
+  if (map_indexed(data, size, cap))
+    return 0;
+  if (S_ISREG(sb.st_mode))
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+  size_t nrec = size / RECORD;
+  for (size_t i = 0; i < nrec; i += BLOCK)
+    add_block(data + i * RECORD, nrec - i < BLOCK ? nrec - i : BLOCK, cap);
+  if (nrec > 0)
+    *last = data[nrec * RECORD - 1];
+
+  // A count with no byte after it: wunzip's fread() of the byte failed,
+  // leaving the previous one in place, and it printed that.  A shorter
+  // tail was not a count at all.
+  if (size % RECORD == 4) {
+    unsigned char *r = malloc(RECORD);
+    if (r == NULL)
+      fail("wunzip");
+    memcpy(r, data + nrec * RECORD, 4);
+    r[4] = *last;
+    add_block(r, 1, cap);
+  }
   return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+  // -r first-last (or first-): just those bytes of the output, counting
+  // from 0, as in an HTTP Range
+  int first = 1, ranged = 0;
+  uint64_t range_first = 0, range_last = 0;
+  if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+    char *end;
+    range_first = strtoull(argv[2], &end, 10);
+    range_last = UINT64_MAX;
+    int ok = end != argv[2] && *end++ == '-';
+    if (ok && *end != '\0')
+      range_last = strtoull(end, &end, 10);
+    if (!ok || *end != '\0' || range_last < range_first) {
+      fprintf(stderr, "wunzip: bad range %s\n", argv[2]);
+      return 1;
+    }
+    ranged = 1;
+    first = 3;
+  }
+  if (argc == first) {
+    printf("wunzip: file1 [file2 ...]\n");
+    return 1;
+  }
+
+  // like wunzip, decode everything before a file that cannot be opened
+  int failed = 0;
+  size_t cap = 0;
+  unsigned char last = 0;
+  for (int i = first; i < argc && !failed; i++)
+    failed = map_file(argv[i], &cap, &last) < 0;
+
+  nthreads = get_nprocs();
+  if ((threads = malloc(nthreads * sizeof(pthread_t))) == NULL)
+    fail("wunzip");
+  start_threads(sum_blocks);
+  join_threads();
+  for (long b = 0; b < nblocks; b++) {
+    blocks[b].start = total;
+    total += blocks[b].len;
+  }
+  from = 0;
+  to = total;
+  if (ranged) {
+    from = range_first < total ? range_first : total;
+    to = range_last < total ? range_last + 1 : total;
+  }
+  if (to == from)
+    return failed;
+  nsegs = (to - from + SEGMENT - 1) / SEGMENT;
+
+  struct stat sb;
+  direct = fstat(STDOUT_FILENO, &sb) == 0 && S_ISREG(sb.st_mode) &&
+           !(fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND) &&
+           (base = lseek(STDOUT_FILENO, 0, SEEK_CUR)) >= 0;
+  if (direct) {
+    start_threads(fill_segments);
+    join_threads();
+    // leave the offset past what was written, as write() would have
+    lseek(STDOUT_FILENO, base + to - from, SEEK_SET);
+    return failed;
+  }
+
+  nslots = nthreads * SLOTS_PER_THREAD;
+  if ((slots = calloc(nslots, sizeof(slot_t))) == NULL)
+    fail("wunzip");
+  start_threads(fill_segments);
+  for (long s = 0; s < nsegs; s++) {
+    slot_t *slot = &slots[s % nslots];
+    pthread_mutex_lock(&lock);
+    while (!(slot->done && slot->seg == s))
+      pthread_cond_wait(&slot_done, &lock);
+    pthread_mutex_unlock(&lock);
+
+    write_all(STDOUT_FILENO, slot->buf, slot->len, 0);
+
+    pthread_mutex_lock(&lock);
+    slot->done = 0;
+    written = s + 1;
+    pthread_cond_broadcast(&slot_free);
+    pthread_mutex_unlock(&lock);
+  }
+  join_threads();
+  return failed;
+}
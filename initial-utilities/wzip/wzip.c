@@ -1,44 +1,239 @@
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define OUT_SIZE (1 << 16)
+
+// records are collected here and written out a buffer at a time; with
+// hold set, the buffer grows to keep all of the output instead
+static char *out;
+static size_t outlen = 0, outcap = OUT_SIZE;
+static int hold = 0;
+
+static void put(const void *p, size_t len) {
+  if (outlen + len > outcap && !hold) {
+    fwrite(out, 1, outlen, stdout);
+    outlen = 0;
+  }
+  while (outlen + len > outcap) {
+    out = realloc(out, outcap *= 2);
+    if (out == NULL) {
+      perror("wzip");
+      exit(1);
+    }
+  }
+  memcpy(out + outlen, p, len);
+  outlen += len;
+}
+
+static void put_record(int count, char c) {
+  char r[5];
+  memcpy(r, &count, 4);
+  r[4] = c;
+  put(r, 5);
+}
+
+// With -i, the output is an indexed container instead of a bare stream of
+// records (see wunzip.c for the reading side):
+//
+//   "WZIX", version (4 bytes)
+//   blocks: records, as usual, for INDEX_BLOCK bytes of input each; a run
+//           that crosses into the next block is split in two there, so
+//           every block decodes on its own
+//   index:  for each block, its offset in the input and in this file
+//           (8 bytes each)
+//   block count, input length (8 bytes each), "WZIX"
+//
+// Numbers are in host byte order, as the counts in the records are.
+
+#define INDEX_MAGIC "WZIX"
+#define INDEX_VERSION 1
+#define INDEX_BLOCK (1 << 20)
+
+static int indexed = 0;
+static uint64_t in_pos = 0;  // input covered by the records so far
+static uint64_t out_pos = 8; // where the next record goes, past the header
+static uint64_t *index_entries = NULL;
+static size_t nindex = 0, index_cap = 0;
+
+static void emit(int count, char c) {
+  if (!indexed) {
+    put_record(count, c);
+    return;
+  }
+  while (count > 0) {
+    if (in_pos % INDEX_BLOCK == 0) {
+      if (nindex == index_cap) {
+        index_cap = index_cap ? index_cap * 2 : 64;
+        index_entries = realloc(index_entries, index_cap * 2 * sizeof(uint64_t));
+        if (index_entries == NULL) {
+          perror("wzip");
+          exit(1);
+        }
+      }
+      index_entries[2 * nindex] = in_pos;
+      index_entries[2 * nindex + 1] = out_pos;
+      nindex++;
+    }
+    int room = INDEX_BLOCK - in_pos % INDEX_BLOCK;
+    int n = count < room ? count : room;
+    put_record(n, c);
+    in_pos += n;
+    out_pos += 5;
+    count -= n;
+  }
+}
+
+static void put_header() {
+  uint32_t version = INDEX_VERSION;
+  put(INDEX_MAGIC, 4);
+  put(&version, 4);
+}
+
+static void put_index() {
+  uint64_t n = nindex;
+  put(index_entries, nindex * 2 * sizeof(uint64_t));
+  put(&n, 8);
+  put(&in_pos, 8);
+  put(INDEX_MAGIC, 4);
+}
+
+// Scanners: each returns the index of the first byte of p[0, n) that is
+// not c, or n if they all are.  The vector ones compare a whole register
+// of bytes against c at once, so a long run costs one compare per 16 or
+// 32 bytes.  The first byte is checked on its own, because in text most
+// runs end right there.
+
+static size_t scan_scalar(const char *p, size_t n, char c) {
+  size_t i = 0;
+  while (i < n && p[i] == c)
+    i++;
+  return i;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2"))) static size_t scan_sse2(const char *p,
+                                                        size_t n, char c) {
+  if (n == 0 || p[0] != c)
+    return 0;
+  __m128i v = _mm_set1_epi8(c);
+  size_t i = 1;
+  for (; i + 16 <= n; i += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + i));
+    unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(b, v)) & 0xffff;
+    if (differ)
+      return i + __builtin_ctz(differ);
+  }
+  return i + scan_scalar(p + i, n - i, c);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *p,
+                                                        size_t n, char c) {
+  if (n == 0 || p[0] != c)
+    return 0;
+  __m256i v = _mm256_set1_epi8(c);
+  size_t i = 1;
+  for (; i + 32 <= n; i += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + i));
+    unsigned differ = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, v));
+    if (differ)
+      return i + __builtin_ctz(differ);
+  }
+  return i + scan_sse2(p + i, n - i, c);
+}
+#endif
+
+// the best scanner this CPU can run
+static size_t (*scan)(const char *, size_t, char) = scan_scalar;
 
 int main(int argc, char *argv[]) {
-  if (argc == 1) {
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-i") == 0) {
+    indexed = 1;
+    first = 2;
+  }
+  if (argc == first) {
     printf("wzip: file1 [file2 ...]\n");
     return 1;
   }
-  char buffer[1024];
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    scan = scan_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    scan = scan_sse2;
+#endif
+  static char buffer[1 << 16];
   size_t size;
 
   int count = 1;
   char last;
   int inited = 0;
 
-  for (int i = 1; i < argc; i++) {
+  out = malloc(outcap);
+  if (out == NULL) {
+    perror("wzip");
+    return 1;
+  }
+  if (indexed) {
+    // a container cut off before its index is of no use to anyone, so
+    // none of it is written until all of it is ready
+    hold = 1;
+    put_header();
+  }
+  for (int i = first; i < argc; i++) {
     FILE *f = fopen(argv[i], "r");
     if (f == NULL) {
+      if (indexed) {
+        perror(argv[i]);
+        return 1;
+      }
+      fwrite(out, 1, outlen, stdout);
       return 1;
     }
 
-    if (!inited) {
-      if (fread(&last, 1, 1, f) == 0) {
-        continue;
-      }
+    if (!inited && fread(&last, 1, 1, f) == 1)
       inited = 1;
-    }
 
-    while ((size = fread(buffer, 1, 1024, f)) > 0) {
-      for (int j = 0; j < size; j++) {
-        if (buffer[j] == last) {
-          count++;
-        } else {
-          fwrite(&count, 4, 1, stdout);
-          fwrite(&last, 1, 1, stdout);
-          count = 1;
-        }
-        last = buffer[j];
+    while (inited && (size = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+      size_t j = 0;
+      while (1) {
+        // last's run goes on up to k; the run may carry on into the next
+        // buffer, or the next file
+        size_t k = j + scan(buffer + j, size - j, last);
+        count += k - j;
+        if (k == size)
+          break;
+        emit(count, last);
+        count = 1;
+        last = buffer[k];
+        j = k + 1;
       }
     }
+    if (indexed && ferror(f)) {
+      perror(argv[i]);
+      return 1;
+    }
+    fclose(f);
+  }
+  if (!indexed) {
+    emit(count, last);
+  } else {
+    // unlike the bare stream, an empty input has no runs at all
+    if (inited)
+      emit(count, last);
+    put_index();
+  }
+  fwrite(out, 1, outlen, stdout);
+  if (indexed && (fflush(stdout) != 0 || ferror(stdout))) {
+    perror("wzip");
+    return 1;
   }
-  fwrite(&count, 4, 1, stdout);
-  fwrite(&last, 1, 1, stdout);
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,94 @@
+#! /bin/bash
+
+# Command throughput of wish in batch mode:
+#   ./bench.sh [lines] [other-wish.c]
+# Runs generated scripts of single commands, '&' groups and pipelines, and
+# reports commands started per second; given another version of wish.c,
+# runs the same scripts with it too, to compare.  Runs them again with
+# lines in parallel (-j), along with a script of commands that wait a
+# little, as tests do.  Then counts the access() calls each makes per
+# command, looking up a handful of commands on a path of five directories.
+
+LINES=${1:-2000}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+gcc -Wall -Werror -O -o $DIR/wish wish.c || exit 1
+tools=(wish)
+if [ -n "$2" ]; then
+    gcc -O -o $DIR/other "$2" || exit 1
+    tools+=(other)
+fi
+
+# a command that spends its time waiting, not running
+{ echo "path /bin /usr/bin"; yes "sleep 0.01" | head -n $((LINES / 10)); } > $DIR/waits
+
+# counts access() calls, into the file named by $ACCESS_COUNT; only the
+# shell's, as it takes itself out of the environment its children get
+cat > $DIR/count.c <<'C'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+static long calls;
+__attribute__((constructor)) static void start() { unsetenv("LD_PRELOAD"); }
+int access(const char *path, int mode) {
+  static int (*real)(const char *, int);
+  if (real == NULL)
+    real = dlsym(RTLD_NEXT, "access");
+  calls++;
+  return real(path, mode);
+}
+__attribute__((destructor)) static void report() {
+  FILE *f = fopen(getenv("ACCESS_COUNT"), "w");
+  if (f != NULL)
+    fprintf(f, "%ld\n", calls);
+}
+C
+gcc -shared -fPIC -O -o $DIR/count.so $DIR/count.c -ldl || exit 1
+
+# name, commands per line, line
+scripts=(
+    "single 1 true"
+    "group 4 true & true & true & true"
+    "pipeline 3 echo x | cat | cat"
+)
+
+now() { date +%s%N; }
+
+for s in "${scripts[@]}"; do
+    read -r name per line <<< "$s"
+    { echo "path /bin /usr/bin"; yes "$line" | head -n $LINES; } > $DIR/$name
+    for tool in "${tools[@]}"; do
+        # an older wish may not know pipes at all
+        [ $tool = other ] && [ $name = pipeline ] && continue
+        start=$(now)
+        $DIR/$tool $DIR/$name > /dev/null 2>&1
+        end=$(now)
+        awk -v name=$name -v tool=$tool -v n=$((LINES * per)) -v ns=$((end - start)) \
+            'BEGIN { printf "%-8s %-5s %8.0f commands/s  (%.3f s)\n", name, tool, n / (ns / 1e9), ns / 1e9 }'
+    done
+done
+
+for name in single group pipeline waits; do
+    per=1
+    case $name in group) per=4 ;; pipeline) per=3 ;; esac
+    n=$LINES
+    [ $name = waits ] && n=$((LINES / 10))
+    for j in 1 8; do
+        start=$(now)
+        $DIR/wish -j $j $DIR/$name > /dev/null 2>&1
+        end=$(now)
+        awk -v name=$name -v tool="-j $j" -v n=$((n * per)) -v ns=$((end - start)) \
+            'BEGIN { printf "%-8s %-5s %8.0f commands/s  (%.3f s)\n", name, tool, n / (ns / 1e9), ns / 1e9 }'
+    done
+done
+
+{
+    echo "path /usr/local/sbin /usr/local/bin /usr/sbin /usr/bin /bin"
+    for i in $(seq $LINES); do echo "true"; echo "echo x"; echo "ls -d ."; echo "cat /dev/null"; done
+} > $DIR/lookups
+for tool in "${tools[@]}"; do
+    ACCESS_COUNT=$DIR/count LD_PRELOAD=$DIR/count.so $DIR/$tool $DIR/lookups > /dev/null 2>&1
+    awk -v tool=$tool -v n=$((LINES * 4)) '{ printf "lookups  %-5s %8.3f access() calls/command\n", tool, $1 / n }' $DIR/count
+done
@@ -0,0 +1,36 @@
+#!/bin/bash
+# a job for test 26.  Each job counts itself in /tmp/wish26/count while it
+# runs, and keeps in /tmp/wish26/peak the most it ever saw there; both
+# are updated under a lock.  A job does not finish until the peak is at
+# least 2, so a shell that runs the jobs one at a time leaves it at 1
+# (after a 10 second wait) instead of passing by luck.
+#   p6.sh        run as a job
+#   p6.sh -c N   check that 1 < peak <= N
+dir=/tmp/wish26
+if [[ $1 == -c ]]; then
+    peak=$(cat $dir/peak)
+    if (( peak > 1 && peak <= $2 )); then
+	echo "peak ok"
+    else
+	echo "peak $peak, wanted 2 to $2"
+    fi
+    exit 0
+fi
+
+(
+    flock 9
+    count=$(( $(cat $dir/count) + 1 ))
+    echo $count > $dir/count
+    if (( count > $(cat $dir/peak) )); then
+	echo $count > $dir/peak
+    fi
+) 9> $dir/lock
+
+for (( i = 0; i < 1000 && $(cat $dir/peak) < 2; i++ )); do
+    sleep 0.01
+done
+
+(
+    flock 9
+    echo $(( $(cat $dir/count) - 1 )) > $dir/count
+) 9> $dir/lock
@@ -1,6 +1,9 @@
 #define _POSIX_C_SOURCE 200809L
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +20,8 @@ typedef struct plist {
 
 typedef enum bool { false, true } bool;
 
+extern char **environ;
+
 plist *pathlist;
 
 plist *create_list() {
@@ -68,6 +73,75 @@ void destroy_list(plist *list) {
   free(list);
 }
 
+// Where commands were last found on the path, so that running one again
+// does not probe every directory with access() again; a shell's "hash"
+// table.  It is forgotten when the path changes, or when the working
+// directory does and the path has a relative directory in it.  A single
+// entry is dropped when starting the program it names fails.
+#define HASH_SIZE 256
+
+typedef struct hash_entry {
+  char *command;
+  char *fullpath;
+  struct hash_entry *next;
+} hash_entry;
+
+hash_entry *hash_table[HASH_SIZE];
+
+hash_entry **hash_bucket(hash_entry **table, const char *command) {
+  unsigned h = 2166136261u;
+  for (const char *c = command; *c != '\0'; c++) {
+    h = (h ^ (unsigned char)*c) * 16777619u;
+  }
+  return &table[h % HASH_SIZE];
+}
+
+char *hash_find(hash_entry **table, const char *command) {
+  for (hash_entry *e = *hash_bucket(table, command); e != NULL; e = e->next) {
+    if (strcmp(e->command, command) == 0) {
+      return e->fullpath;
+    }
+  }
+  return NULL;
+}
+
+void hash_add(hash_entry **table, const char *command,
+              const char *fullpath) {
+  hash_entry **bucket = hash_bucket(table, command);
+  hash_entry *e = malloc(sizeof(hash_entry));
+  e->command = strdup(command);
+  e->fullpath = strdup(fullpath);
+  e->next = *bucket;
+  *bucket = e;
+}
+
+void hash_forget(hash_entry **table, const char *command) {
+  for (hash_entry **p = hash_bucket(table, command); *p != NULL;
+       p = &(*p)->next) {
+    if (strcmp((*p)->command, command) == 0) {
+      hash_entry *e = *p;
+      *p = e->next;
+      free(e->command);
+      free(e->fullpath);
+      free(e);
+      return;
+    }
+  }
+}
+
+void hash_clear(hash_entry **table) {
+  for (int i = 0; i < HASH_SIZE; i++) {
+    while (table[i] != NULL) {
+      hash_forget(table, table[i]->command);
+    }
+  }
+}
+
+bool is_internal_command(char *command) {
+  return strcmp(command, "exit") == 0 || strcmp(command, "cd") == 0 ||
+         strcmp(command, "path") == 0;
+}
+
 bool run_internal_commmand(char *command, plist *arglist) {
   if (strcmp(command, "exit") == 0) {
     // exit
@@ -84,11 +158,19 @@ bool run_internal_commmand(char *command, plist *arglist) {
     }
     if (chdir(arglist->list[1]) == -1) {
       print_error();
+      return true;
+    }
+    for (int i = 0; i < pathlist->len; i++) {
+      if (((char *)pathlist->list[i])[0] != '/') {
+        hash_clear(hash_table);
+        break;
+      }
     }
     return true;
   } else if (strcmp(command, "path") == 0) {
     // path
     clear_and_free_list_element(pathlist);
+    hash_clear(hash_table);
     for (int i = 1; i < arglist->len; i++) {
       add_item(pathlist, strdup(arglist->list[i]));
     }
@@ -97,7 +179,96 @@ bool run_internal_commmand(char *command, plist *arglist) {
   return false;
 }
 
-pid_t run_command(char *sub) {
+// returns the program command names, found on the path, or NULL
+char *find_command(char *command) {
+  char *known = hash_find(hash_table, command);
+  if (known != NULL) {
+    return strdup(known);
+  }
+
+  int len = 50;
+  char *fullpath = malloc(len);
+
+  for (int i = 0; i < pathlist->len; i++) {
+    if (len < strlen(command) + strlen(pathlist->list[i]) + 2) {
+      len = strlen(command) + strlen(pathlist->list[i]) + 2;
+      fullpath = realloc(fullpath, len);
+    }
+    sprintf(fullpath, "%s/%s", (char *)pathlist->list[i], command);
+    if (!access(fullpath, X_OK)) {
+      hash_add(hash_table, command, fullpath);
+      return fullpath;
+    }
+  }
+  free(fullpath);
+  return NULL;
+}
+
+// Starts the stages of a pipeline, all at once, each one's output piped to
+// the next one's input; the last one's output (and error) goes to
+// redirectfilename, if there is one.  Children are started with
+// posix_spawn(), which does not copy the shell's memory the way fork()
+// does, and the pipes are made close-on-exec so that each child keeps only
+// the ends it was given.
+void spawn_pipeline(plist *stages, plist *paths, char *redirectfilename,
+                    plist *pidlist) {
+  int in = -1; // read end of the pipe from the stage before
+  for (int i = 0; i < stages->len; i++) {
+    int p[2] = {-1, -1};
+    if (i < stages->len - 1 && pipe2(p, O_CLOEXEC) == -1) {
+      print_error();
+      break;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in != -1) {
+      posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if (p[1] != -1) {
+      posix_spawn_file_actions_adddup2(&actions, p[1], STDOUT_FILENO);
+    } else if (redirectfilename != NULL) {
+      posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+                                       redirectfilename,
+                                       O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+                                       STDERR_FILENO);
+    }
+
+    pid_t pid;
+    plist *arglist = stages->list[i];
+    char **argv = (char **)arglist->list;
+    int err = posix_spawn(&pid, paths->list[i], &actions, NULL, argv, environ);
+    if (err != 0) {
+      // the program may have gone from where it was found; look again
+      hash_forget(hash_table, argv[0]);
+      char *fullpath = find_command(argv[0]);
+      if (fullpath != NULL && strcmp(fullpath, paths->list[i]) != 0) {
+        err = posix_spawn(&pid, fullpath, &actions, NULL, argv, environ);
+      }
+      free(fullpath);
+    }
+    if (err != 0) {
+      print_error();
+    } else {
+      add_item(pidlist, (void *)(long)pid);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (in != -1) {
+      close(in);
+    }
+    if (p[1] != -1) {
+      close(p[1]);
+    }
+    in = p[0];
+  }
+  if (in != -1) {
+    close(in);
+  }
+}
+
+void run_command(char *sub, plist *pidlist) {
   char *token = NULL;
   char *redirect = sub;
   sub = strsep(&redirect, ">");
@@ -113,93 +284,67 @@ pid_t run_command(char *sub) {
       redirectfilename = token;
     } else {
       print_error();
-      return 0;
+      return;
     }
   }
   if (r == true && redirectfilename == NULL) {
     print_error();
-    return 0;
+    return;
   }
 
-  token = NULL;
-  plist *arglist = create_list();
-  char *command = NULL;
-  // parse command and arg
-  while ((token = strsep(&sub, "\r\n ")) != NULL) {
-    if (check_empty(token)) {
-      continue;
-    }
-    if (command == NULL) {
-      command = token;
-      add_item(arglist, token);
-    } else {
-      add_item(arglist, token);
+  // parse the stages of the pipeline, and the command and args of each
+  plist *stages = create_list();
+  bool empty = false;
+  char *part = NULL;
+  while ((part = strsep(&sub, "|")) != NULL) {
+    plist *arglist = create_list();
+    while ((token = strsep(&part, "\r\n ")) != NULL) {
+      if (!check_empty(token)) {
+        add_item(arglist, token);
+      }
     }
+    empty = empty || arglist->len == 0;
+    add_item(stages, arglist);
   }
 
-  if (command == NULL) {
+  plist *paths = create_list();
+  if (stages->len == 1 && empty) {
     if (r == true) {
       print_error();
     }
-    return 0;
-  }
-
-  if (run_internal_commmand(command, arglist)) {
-    destroy_list(arglist);
-    return 0;
+  } else if (empty) {
+    // "| cmd", "cmd |", "cmd | | cmd"
+    print_error();
+  } else if (stages->len == 1 &&
+             run_internal_commmand(((plist *)stages->list[0])->list[0],
+                                   stages->list[0])) {
+    // a built-in, and it has run
   } else {
-    // isn't bulit-in command
-    int len = 50;
-    char *fullpath = malloc(len);
-
-    bool find = false;
-    for (int i = 0; i < pathlist->len; i++) {
-      if (len < strlen(command) + strlen(pathlist->list[i]) + 2) {
-        len = strlen(command) + strlen(pathlist->list[i]) + 2;
-        fullpath = realloc(fullpath, len);
+    // isn't bulit-in command; every stage has to be found, or none runs
+    for (int i = 0; i < stages->len; i++) {
+      char *command = ((plist *)stages->list[i])->list[0];
+      // built-ins change the shell itself, so not from inside a pipeline
+      char *fullpath = NULL;
+      if (stages->len == 1 || !is_internal_command(command)) {
+        fullpath = find_command(command);
       }
-      sprintf(fullpath, "%s/%s", (char *)pathlist->list[i], command);
-      if (!access(fullpath, X_OK)) {
-        find = true;
+      if (fullpath == NULL) {
+        print_error();
         break;
       }
+      add_item(paths, fullpath);
     }
-
-    if (!find) {
-      print_error();
-      return 0;
+    if (paths->len == stages->len) {
+      spawn_pipeline(stages, paths, redirectfilename, pidlist);
     }
+  }
 
-    pid_t pid = fork();
-
-    if (pid == -1) {
-      print_error();
-      return 0;
-    }
-    if (pid == 0) {
-      // child
-      // set redirect
-      if (redirectfilename != NULL) {
-        int fd = open(redirectfilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-          print_error();
-          return 0;
-        }
-        dup2(fd, STDOUT_FILENO);
-        dup2(fd, STDERR_FILENO);
-      }
-
-      if (execv(fullpath, (char **)arglist->list) == -1) {
-        print_error();
-        exit(1);
-      }
-    } else {
-      // parent
-      destroy_list(arglist);
-      return pid;
-    }
+  clear_and_free_list_element(paths);
+  destroy_list(paths);
+  for (int i = 0; i < stages->len; i++) {
+    destroy_list(stages->list[i]);
   }
-  return 0;
+  destroy_list(stages);
 }
 
 void main_loop(bool interactive) {
@@ -216,10 +361,7 @@ void main_loop(bool interactive) {
       char *sub = NULL;
       while ((sub = strsep(&line, "&")) != NULL) {
         if (!check_empty(sub)) {
-          pid_t pid = run_command(sub);
-          if (pid > 0) {
-            add_item(pidlist, (void *)(long)pid);
-          }
+          run_command(sub, pidlist);
         }
       }
 
@@ -238,10 +380,178 @@ void main_loop(bool interactive) {
   }
 }
 
+// With -j N, a batch file's lines run as jobs, up to N of them at once:
+// the shell reads on and starts the next line without waiting for the ones
+// before it, unless
+//   - N are running; it waits for one to finish,
+//   - the line names a file that an earlier, still running, line names
+//     too, and the script has redirected to it at some point (so "ls >
+//     out", "cat out" and "rm out" keep their order); it waits for those
+//     lines,
+//   - the line has a built-in, which changes the shell for the lines after
+//     it; it waits for all.
+// Files are compared by name, as written.
+typedef struct job {
+  plist *pids;  // its children still running
+  plist *words; // every word on its line
+  bool barrier; // runs a built-in
+} job;
+
+// every file the script has redirected to so far
+hash_entry *written[HASH_SIZE];
+
+// notes down the words of a line, before running it takes the line apart
+job *scan_line(const char *line) {
+  job *j = malloc(sizeof(job));
+  j->pids = create_list();
+  j->words = create_list();
+  j->barrier = false;
+
+  char *copy = strdup(line);
+  char *rest = copy, *sub = NULL;
+  while ((sub = strsep(&rest, "&")) != NULL) {
+    char *redirect = sub;
+    char *command = strsep(&redirect, ">");
+    char *stage = NULL, *token = NULL;
+    while ((stage = strsep(&command, "|")) != NULL) {
+      bool first = true;
+      while ((token = strsep(&stage, "\r\n ")) != NULL) {
+        if (check_empty(token)) {
+          continue;
+        }
+        if (first && is_internal_command(token)) {
+          j->barrier = true;
+        }
+        first = false;
+        add_item(j->words, strdup(token));
+      }
+    }
+    while ((token = strsep(&redirect, "\r\n ")) != NULL) {
+      if (!check_empty(token)) {
+        add_item(j->words, strdup(token));
+        if (hash_find(written, token) == NULL) {
+          hash_add(written, token, token);
+        }
+      }
+    }
+  }
+  free(copy);
+  return j;
+}
+
+void free_job(job *j) {
+  destroy_list(j->pids);
+  clear_and_free_list_element(j->words);
+  destroy_list(j->words);
+  free(j);
+}
+
+bool in_list(plist *list, const char *word) {
+  for (int i = 0; i < list->len; i++) {
+    if (strcmp(list->list[i], word) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// whether the two name a file that is written to
+bool conflicts(job *a, job *b) {
+  for (int i = 0; i < a->words->len; i++) {
+    if (in_list(b->words, a->words->list[i]) &&
+        hash_find(written, a->words->list[i]) != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void remove_item(plist *list, int i) {
+  list->list[i] = list->list[--list->len];
+  list->list[list->len] = NULL;
+}
+
+// waits for a child of any running job; a job is done with once all its
+// children are
+void reap(plist *running) {
+  int wstatus = 0;
+  pid_t pid;
+  while ((pid = waitpid(-1, &wstatus, 0)) == -1 && errno == EINTR) {
+  }
+  // no children at all means none of these is running
+  bool none_left = pid == -1 && errno == ECHILD;
+  for (int i = 0; i < running->len; i++) {
+    job *j = running->list[i];
+    for (int k = 0; k < j->pids->len; k++) {
+      if (none_left || (pid != -1 && (pid_t)(long)j->pids->list[k] == pid)) {
+        remove_item(j->pids, k--);
+      }
+    }
+    if (j->pids->len == 0) {
+      free_job(j);
+      remove_item(running, i--);
+    }
+  }
+}
+
+bool must_wait(plist *running, job *j, int jobs) {
+  if (running->len == 0) {
+    return false;
+  }
+  if (j->barrier || running->len >= jobs) {
+    return true;
+  }
+  for (int i = 0; i < running->len; i++) {
+    if (conflicts(running->list[i], j)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void parallel_loop(int jobs) {
+  char *line = NULL;
+  size_t buflen = 0;
+  plist *running = create_list();
+  while (getline(&line, &buflen, stdin) != -1) {
+    job *j = scan_line(line);
+    while (must_wait(running, j, jobs)) {
+      reap(running);
+    }
+
+    char *rest = line, *sub = NULL;
+    while ((sub = strsep(&rest, "&")) != NULL) {
+      if (!check_empty(sub)) {
+        run_command(sub, j->pids);
+      }
+    }
+    if (j->pids->len > 0) {
+      add_item(running, j);
+    } else {
+      free_job(j);
+    }
+  }
+  while (running->len > 0) {
+    reap(running);
+  }
+  exit(0);
+}
+
 int main(int argc, char *argv[]) {
   pathlist = create_list();
   char *initpath = strdup("/bin");
   add_item(pathlist, initpath);
+  int jobs = 0;
+  if (argc == 4 && strcmp(argv[1], "-j") == 0) {
+    // batch, with lines run in parallel
+    jobs = atoi(argv[2]);
+    if (jobs < 1) {
+      print_error();
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+  }
   if (argc == 1) {
     // interactive
     main_loop(true);
@@ -254,6 +564,9 @@ int main(int argc, char *argv[]) {
       exit(1);
     }
 
+    if (jobs > 0) {
+      parallel_loop(jobs);
+    }
     main_loop(false);
   } else {
     // error